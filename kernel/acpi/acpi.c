@@ -19,10 +19,12 @@
 #include "../cpu/ports.h"
 #include "../kernel/panic.h"
 #include "../klibc/printf.h"
+#include "../klibc/vec.h"
 #include "../mm/vmm.h"
 #include "../sys/hpet.h"
 #include "../sys/pci.h"
 #include "madt.h"
+#include "srat.h"
 #include <lai/core.h>
 #include <lai/drivers/ec.h>
 #include <lai/helpers/sci.h>
@@ -32,9 +34,61 @@
 #include <stddef.h>
 #include <stdint.h>
 
-static bool use_xsdt;
-static struct rsdt *rsdt;
+typedef vec_t(acpi_header_t *) sdt_vec_t;
+
 static uint8_t revision;
+// Kernel heap copies of the tables, ACPI reclaimable memory is handed to the
+// PMM once they are parsed
+static sdt_vec_t sdts;
+static acpi_header_t *dsdt = NULL;
+
+static uint8_t acpi_checksum(void *ptr, size_t size);
+
+__attribute__((always_inline)) inline bool is_canonical(uint64_t addr) {
+	return ((addr <= 0x00007FFFFFFFFFFF) ||
+			((addr >= 0xFFFF800000000000) && (addr <= 0xFFFFFFFFFFFFFFFF)));
+}
+
+static acpi_header_t *acpi_copy_table(uintptr_t phys) {
+	acpi_header_t *table = (acpi_header_t *)(phys + MEM_PHYS_OFFSET);
+	if (acpi_checksum(table, table->length))
+		return NULL;
+
+	acpi_header_t *copy = kmalloc(table->length);
+	memcpy(copy, table, table->length);
+	return copy;
+}
+
+static void acpi_copy_tables(struct rsdt *rsdt, bool use_xsdt) {
+	vec_init(&sdts);
+
+	const size_t entries =
+		(rsdt->header.length - sizeof(acpi_header_t)) / (use_xsdt ? 8 : 4);
+
+	for (size_t i = 0; i < entries; i++) {
+		uintptr_t ptr;
+		if (use_xsdt) {
+			ptr = (uintptr_t)((uint64_t *)rsdt->ptrs_start)[i];
+		} else {
+			ptr = (uintptr_t)((uint32_t *)rsdt->ptrs_start)[i];
+		}
+
+		acpi_header_t *table = acpi_copy_table(ptr);
+		if (table)
+			vec_push(&sdts, table);
+	}
+
+	// The DSDT must be found using a pointer in the FADT
+	acpi_fadt_t *facp = acpi_find_sdt("FACP", 0);
+	if (facp == NULL)
+		return;
+
+	if (is_canonical(facp->x_dsdt) && revision >= 2 && facp->x_dsdt) {
+		dsdt = acpi_copy_table(facp->x_dsdt);
+	} else {
+		dsdt = acpi_copy_table(facp->dsdt);
+	}
+}
 
 static void init_ec(void) {
 	LAI_CLEANUP_STATE lai_state_t state;
@@ -69,6 +123,8 @@ void acpi_init(acpi_xsdp_t *rsdp) {
 	printf("ACPI: Revision: %hhu\n", rsdp->revision);
 	revision = rsdp->revision;
 
+	bool use_xsdt;
+	struct rsdt *rsdt;
 	if (rsdp->revision >= 2 && rsdp->xsdt) {
 		use_xsdt = true;
 		rsdt = (struct rsdt *)((uintptr_t)rsdp->xsdt + MEM_PHYS_OFFSET);
@@ -78,6 +134,9 @@ void acpi_init(acpi_xsdp_t *rsdp) {
 		rsdt = (struct rsdt *)((uintptr_t)rsdp->rsdt + MEM_PHYS_OFFSET);
 		printf("ACPI: Found RSDT at %llX\n", (uintptr_t)rsdt);
 	}
+	acpi_copy_tables(rsdt, use_xsdt);
+	printf("ACPI: Copied %d tables to the kernel heap\n", sdts.length);
+	srat_init();
 	hpet_init();
 	pci_init();
 	lai_set_acpi_revision(revision);
@@ -101,20 +160,10 @@ static uint8_t acpi_checksum(void *ptr, size_t size) {
 void *acpi_find_sdt(const char *signature, int index) {
 	int cnt = 0;
 
-	const size_t entries =
-		(rsdt->header.length - sizeof(acpi_header_t)) / (use_xsdt ? 8 : 4);
-
-	for (size_t i = 0; i < entries; i++) {
-		acpi_header_t *ptr;
-		if (use_xsdt) {
-			ptr = (acpi_header_t *)(uintptr_t)((uint64_t *)rsdt->ptrs_start)[i];
-		} else {
-			ptr = (acpi_header_t *)(uintptr_t)((uint32_t *)rsdt->ptrs_start)[i];
-		}
-
-		if (!memcmp(ptr->signature, signature, 4) &&
-			!acpi_checksum(ptr, ptr->length) && cnt++ == index) {
-			return (void *)ptr + MEM_PHYS_OFFSET;
+	for (int i = 0; i < sdts.length; i++) {
+		if (!memcmp(sdts.data[i]->signature, signature, 4) &&
+			cnt++ == index) {
+			return sdts.data[i];
 		}
 	}
 
@@ -165,24 +214,9 @@ void laihost_unmap(void *pointer, size_t count) {
 	(void)count;
 }
 
-__attribute__((always_inline)) inline bool is_canonical(uint64_t addr) {
-	return ((addr <= 0x00007FFFFFFFFFFF) ||
-			((addr >= 0xFFFF800000000000) && (addr <= 0xFFFFFFFFFFFFFFFF)));
-}
-
 void *laihost_scan(const char *signature, size_t index) {
-	// The DSDT must be found using a pointer in the FADT
 	if (!memcmp(signature, "DSDT", 4)) {
-		acpi_fadt_t *facp = acpi_find_sdt("FACP", 0);
-		uint64_t dsdt_addr = 0;
-
-		if (is_canonical(facp->x_dsdt) && revision >= 2) {
-			dsdt_addr = facp->x_dsdt;
-		} else {
-			dsdt_addr = facp->dsdt;
-		}
-
-		return (void *)dsdt_addr + MEM_PHYS_OFFSET;
+		return dsdt;
 	} else {
 		return acpi_find_sdt(signature, index);
 	}
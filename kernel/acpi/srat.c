@@ -0,0 +1,147 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "srat.h"
+#include "../klibc/printf.h"
+#include "../klibc/vec.h"
+#include "../mm/pmm.h"
+
+#define SRAT_ENABLED (1 << 0)
+// Relative distances from the SLIT, used when there's none
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+struct lapic_node {
+	uint32_t lapic_id;
+	size_t node;
+};
+
+typedef vec_t(struct lapic_node) lapic_node_vec_t;
+
+static lapic_node_vec_t lapic_nodes;
+// Proximity domain of each node, nodes are numbered in order of appearance
+static uint32_t node_domains[PMM_MAX_NODES];
+static size_t node_count = 0;
+static struct pmm_numa_range ranges[PMM_MAX_NUMA_RANGES];
+static size_t range_count = 0;
+static uint8_t distances[PMM_MAX_NODES][PMM_MAX_NODES];
+
+static size_t domain_to_node(uint32_t domain) {
+	for (size_t i = 0; i < node_count; i++)
+		if (node_domains[i] == domain)
+			return i;
+
+	if (node_count == PMM_MAX_NODES) {
+		printf("ACPI/SRAT: Too many nodes, domain %u goes to node 0\n",
+			   domain);
+		return 0;
+	}
+
+	node_domains[node_count] = domain;
+	return node_count++;
+}
+
+static void init_slit(void) {
+	for (size_t i = 0; i < PMM_MAX_NODES; i++)
+		for (size_t j = 0; j < PMM_MAX_NODES; j++)
+			distances[i][j] =
+				i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+
+	struct slit *slit = acpi_find_sdt("SLIT", 0);
+	if (!slit)
+		return;
+
+	for (size_t i = 0; i < node_count; i++) {
+		for (size_t j = 0; j < node_count; j++) {
+			uint64_t from = node_domains[i], to = node_domains[j];
+			if (from < slit->localities && to < slit->localities)
+				distances[i][j] = slit->entries[from * slit->localities + to];
+		}
+	}
+}
+
+// Node the CPU with this local APIC ID belongs to
+size_t srat_lapic_node(uint32_t lapic_id) {
+	for (int i = 0; i < lapic_nodes.length; i++)
+		if (lapic_nodes.data[i].lapic_id == lapic_id)
+			return lapic_nodes.data[i].node;
+	return 0;
+}
+
+void srat_init(void) {
+	vec_init(&lapic_nodes);
+
+	struct srat *srat = acpi_find_sdt("SRAT", 0);
+	if (!srat) {
+		printf("ACPI/SRAT: Not found, assuming a single node\n");
+		return;
+	}
+
+	for (uint8_t *srat_ptr = (uint8_t *)srat->srat_entries_begin;
+		 (uintptr_t)srat_ptr < (uintptr_t)srat + srat->sdt.length;
+		 srat_ptr += *(srat_ptr + 1)) {
+		if (*(srat_ptr + 1) == 0)
+			break;
+
+		switch (*(srat_ptr)) {
+			case 0: {
+				// Processor local APIC affinity
+				struct srat_lapic *lapic = (void *)srat_ptr;
+				if (!(lapic->flags & SRAT_ENABLED))
+					break;
+				uint32_t domain = lapic->proximity_domain_lo |
+								  lapic->proximity_domain_hi[0] << 8 |
+								  lapic->proximity_domain_hi[1] << 16 |
+								  lapic->proximity_domain_hi[2] << 24;
+				struct lapic_node entry = {lapic->apic_id,
+										   domain_to_node(domain)};
+				vec_push(&lapic_nodes, entry);
+				break;
+			}
+			case 1: {
+				// Memory affinity
+				struct srat_memory *memory = (void *)srat_ptr;
+				if (!(memory->flags & SRAT_ENABLED) || !memory->length)
+					break;
+				size_t node = domain_to_node(memory->proximity_domain);
+				if (range_count == PMM_MAX_NUMA_RANGES)
+					break;
+				ranges[range_count].base = memory->base;
+				ranges[range_count].length = memory->length;
+				ranges[range_count].node = node;
+				range_count++;
+				printf("ACPI/SRAT: Memory 0x%llX-0x%llX on node %zu\n",
+					   memory->base, memory->base + memory->length, node);
+				break;
+			}
+			case 2: {
+				// Processor local x2APIC affinity
+				struct srat_x2apic *x2apic = (void *)srat_ptr;
+				if (!(x2apic->flags & SRAT_ENABLED))
+					break;
+				struct lapic_node entry = {
+					x2apic->x2apic_id,
+					domain_to_node(x2apic->proximity_domain)};
+				vec_push(&lapic_nodes, entry);
+				break;
+			}
+		}
+	}
+
+	printf("ACPI/SRAT: %zu nodes, %d CPUs\n", node_count, lapic_nodes.length);
+	init_slit();
+	pmm_numa_init(ranges, range_count, node_count, distances);
+}
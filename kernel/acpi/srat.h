@@ -0,0 +1,76 @@
+#ifndef SRAT_H
+#define SRAT_H
+
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "acpi.h"
+#include <stddef.h>
+#include <stdint.h>
+
+struct srat {
+	acpi_header_t sdt;
+	uint32_t table_revision;
+	uint64_t reserved;
+	char srat_entries_begin[];
+} __attribute__((packed));
+
+struct srat_header {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed));
+
+struct srat_lapic {
+	struct srat_header sratHeader;
+	uint8_t proximity_domain_lo;
+	uint8_t apic_id;
+	uint32_t flags;
+	uint8_t sapic_eid;
+	uint8_t proximity_domain_hi[3];
+	uint32_t clock_domain;
+} __attribute__((packed));
+
+struct srat_memory {
+	struct srat_header sratHeader;
+	uint32_t proximity_domain;
+	uint16_t reserved;
+	uint64_t base;
+	uint64_t length;
+	uint32_t reserved2;
+	uint32_t flags;
+	uint64_t reserved3;
+} __attribute__((packed));
+
+struct srat_x2apic {
+	struct srat_header sratHeader;
+	uint16_t reserved;
+	uint32_t proximity_domain;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t clock_domain;
+	uint32_t reserved2;
+} __attribute__((packed));
+
+struct slit {
+	acpi_header_t sdt;
+	uint64_t localities;
+	uint8_t entries[];
+} __attribute__((packed));
+
+void srat_init(void);
+size_t srat_lapic_node(uint32_t lapic_id);
+
+#endif
@@ -24,7 +24,6 @@
 #include "../sys/mmio.h"
 #include "cpu.h"
 #include "isr.h"
-#include <cpuid.h>
 #include <lai/helpers/pm.h>
 #include <lai/helpers/sci.h>
 
@@ -96,13 +95,10 @@ void lapic_init(uint8_t processor_id) {
 	uint64_t apic_msr = rdmsr(0x1B);
 	// Set enable flag
 	apic_msr |= 1 << 11;
-	uint32_t a = 0, b = 0, c = 0, d = 0;
-	if (__get_cpuid(1, &a, &b, &c, &d)) {
-		if (c & CPUID_X2APIC) {
-			x2apic = true;
-			// Set x2APIC flag
-			apic_msr |= 1 << 10;
-		}
+	if (cpu_has(CPU_FEATURE_X2APIC)) {
+		x2apic = true;
+		// Set x2APIC flag
+		apic_msr |= 1 << 10;
 	}
 	wrmsr(0x1B, apic_msr);
 	// Initialize local APIC
@@ -16,20 +16,25 @@
  */
 
 #include "cpu.h"
+#include "../acpi/srat.h"
 #include "../kernel/panic.h"
 #include "../klibc/alloc.h"
 #include "../klibc/asm.h"
 #include "../klibc/lock.h"
 #include "../klibc/mem.h"
 #include "../klibc/printf.h"
+#include "../mm/vmm.h"
 #include "../sys/gdt.h"
 #include "../sys/hpet.h"
 #include "apic.h"
+#include "idt.h"
+#include "isr.h"
 #include "syscall.h"
 #include <cpuid.h>
 #include <liballoc.h>
 
 struct cpu_local *cpu_locals = {0};
+struct cpu_features cpu_features = {0};
 uint64_t cpu_count = 0;
 
 static void cpu_init(struct stivale2_smp_info *smp_info);
@@ -79,21 +84,75 @@ static void fxrstor(void *region) {
 	asm volatile("fxrstor %0" : : "m"(FLAT_PTR(region)) : "memory");
 }
 
+// Reads the feature bits of the CPU it runs on
+void cpu_features_init(struct cpu_features *features) {
+	uint32_t a = 0, b = 0, c = 0, d = 0;
+	if (__get_cpuid(1, &a, &b, &c, &d)) {
+		features->words[CPUID_1_ECX] = c;
+		features->words[CPUID_1_EDX] = d;
+	}
+	if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+		features->words[CPUID_7_EBX] = b;
+		features->words[CPUID_7_ECX] = c;
+		features->words[CPUID_7_EDX] = d;
+	}
+	if (__get_cpuid(0x80000001, &a, &b, &c, &d)) {
+		features->words[CPUID_80000001_ECX] = c;
+		features->words[CPUID_80000001_EDX] = d;
+	}
+	if (__get_cpuid(0x80000007, &a, &b, &c, &d))
+		features->words[CPUID_80000007_EDX] = d;
+}
+
+static void call_handler(registers_t *reg) {
+	(void)reg;
+	void (*func)(void *) = this_cpu->call_func;
+	void *arg = this_cpu->call_arg;
+	// The arguments were read, another call may be made from here on
+	__sync_lock_release(&this_cpu->call_func);
+	if (func != NULL)
+		func(arg);
+}
+
+// Makes "cpu" run "func" from an interrupt handler, with interrupts off,
+// without waiting for it. Returns false if it didn't start the previous call
+// yet
+bool smp_call(size_t cpu, void (*func)(void *), void *arg) {
+	struct cpu_local *target = &cpu_locals[cpu];
+	if (target->call_func != NULL)
+		return false;
+	target->call_arg = arg;
+	if (!__sync_bool_compare_and_swap(&target->call_func, NULL, func))
+		return false;
+	// Fixed delivery, level assert
+	apic_send_ipi(target->lapic_id, CPU_CALL_VECTOR | (1 << 14));
+	return true;
+}
+
 void smp_init(struct stivale2_struct_tag_smp *smp_tag) {
 	printf("CPU: Total processor count: %d\n", smp_tag->cpu_count);
 	bsp_lapic_id = smp_tag->bsp_lapic_id;
+	isr_register_handler(CPU_CALL_VECTOR, call_handler);
 	cpu_locals = kcalloc(sizeof(struct cpu_local), smp_tag->cpu_count);
 	for (size_t i = 0; i < smp_tag->cpu_count; ++i) {
 		smp_tag->smp_info[i].extra_argument = (uint64_t)&cpu_locals[i];
+		// IST 1 for severe exceptions, IST 2 for page faults, see isr_install()
+		uint8_t *ist1 = kstack_alloc("IST 1 of CPU", i);
+		uint8_t *ist2 = kstack_alloc("IST 2 of CPU", i);
+		if (ist1 == NULL || ist2 == NULL)
+			PANIC("Failed to allocate IST stacks");
+		cpu_locals[i].cpu_tss.ist1 = (uint64_t)ist1 + KSTACK_SIZE;
+		cpu_locals[i].cpu_tss.ist2 = (uint64_t)ist2 + KSTACK_SIZE;
 		if (smp_tag->smp_info[i].lapic_id == bsp_lapic_id) {
 			cpu_init((void *)&smp_tag->smp_info[i]);
 			continue;
 		}
 		cpu_locals[i].cpu_number = i;
-		uint8_t *stack = kmalloc(KSTACK_SIZE);
-		cpu_locals[i].cpu_tss.rsp0 = (uint64_t)stack;
-		uint8_t *sched_stack = kmalloc(KSTACK_SIZE);
-		cpu_locals[i].cpu_tss.ist1 = (uint64_t)sched_stack;
+		// The AP runs its scheduler on this stack once it's up
+		uint8_t *stack = kstack_alloc("scheduler stack of CPU", i);
+		if (stack == NULL)
+			PANIC("Failed to allocate CPU stack");
+		cpu_locals[i].cpu_tss.rsp0 = (uint64_t)stack + KSTACK_SIZE;
 		smp_tag->smp_info[i].target_stack = (uintptr_t)stack + KSTACK_SIZE;
 		smp_tag->smp_info[i].goto_address = (uintptr_t)cpu_init;
 		hpet_usleep(10000);
@@ -120,30 +179,34 @@ void wsmp_cpu_init(void) {
 	write_cr("4", cr4);
 
 	// Enable some modern minor x86_64 features, ported from Sigma OS
-	uint32_t a = 0, b = 0, c = 0, d = 0;
-	if (__get_cpuid(7, &a, &b, &c, &d)) {
-		if ((b & CPUID_SMEP)) {
-			cr4 = read_cr("4");
-			cr4 |= (1 << 20); // Enable SMEP
-			write_cr("4", cr4);
-		}
+	if (cpu_has(CPU_FEATURE_SMEP)) {
+		cr4 = read_cr("4");
+		cr4 |= (1 << 20); // Enable SMEP
+		write_cr("4", cr4);
 	}
 
-	if (__get_cpuid(7, &a, &b, &c, &d)) {
-		if ((b & CPUID_SMAP)) {
-			cr4 = read_cr("4");
-			cr4 |= (1 << 21); // Enable SMAP
-			write_cr("4", cr4);
-			asm("clac");
-		}
+	if (cpu_has(CPU_FEATURE_SMAP)) {
+		cr4 = read_cr("4");
+		cr4 |= (1 << 21); // Enable SMAP
+		write_cr("4", cr4);
+		asm("clac");
 	}
 
-	if (__get_cpuid(7, &a, &b, &c, &d)) {
-		if ((c & CPUID_UMIP)) {
-			cr4 = read_cr("4");
-			cr4 |= (1 << 11); // Enable UMIP
-			write_cr("4", cr4);
-		}
+	cr4 = read_cr("4");
+	cr4 |= (1 << 7); // Enable global pages
+	write_cr("4", cr4);
+
+	// CR3 holds no PCID yet, as required to enable them
+	if (cpu_has(CPU_FEATURE_PCID)) {
+		cr4 = read_cr("4");
+		cr4 |= (1 << 17); // Enable PCIDs
+		write_cr("4", cr4);
+	}
+
+	if (cpu_has(CPU_FEATURE_UMIP)) {
+		cr4 = read_cr("4");
+		cr4 |= (1 << 11); // Enable UMIP
+		write_cr("4", cr4);
 	}
 
 	// Initialize the PAT
@@ -156,19 +219,37 @@ void wsmp_cpu_init(void) {
 
 static void cpu_init(struct stivale2_smp_info *smp_info) {
 	LOCK(cpu_lock);
-	gdt_init();
 	// Load CPU local address in gsbase
 	wrmsr(0xC0000101, (uintptr_t)smp_info->extra_argument);
+	// APs come up on the bootloader's page tables and IDT, which live in
+	// memory pmm_reclaim() gives back later
+	vmm_switch_pagemap(kernel_pagemap);
+	gdt_init();
+	// Every CPU needs its own IST stacks
+	gdt_load_tss((size_t)&this_cpu->cpu_tss);
+	set_idt();
 	printf("CPU: Processor %d online!\n", this_cpu->cpu_number);
 
 	this_cpu->lapic_id = smp_info->lapic_id;
+	this_cpu->numa_node = srat_lapic_node(smp_info->lapic_id);
+	// cpu_has() only looks at the BSP's features, every CPU needs them all.
+	// OSXSAVE follows CR4, which the bootloader may have set on the BSP only
+	struct cpu_features features = {0};
+	cpu_features_init(&features);
+	features.words[CPUID_1_ECX] |= 1 << 27;
+	for (int i = 0; i < CPUID_WORDS; i++) {
+		if (cpu_features.words[i] & ~features.words[i]) {
+			printf("CPU: Processor %d lacks features %x of CPUID word %d\n",
+				   this_cpu->cpu_number,
+				   cpu_features.words[i] & ~features.words[i], i);
+			PANIC("A processor lacks features of the BSP");
+		}
+	}
 
 	wsmp_cpu_init();
 
 	uint64_t cr4 = 0;
-	uint32_t a = 0, b = 0, c = 0, d = 0;
-	__get_cpuid(1, &a, &b, &c, &d);
-	if ((c & bit_XSAVE)) {
+	if (cpu_has(CPU_FEATURE_XSAVE)) {
 		cr4 = read_cr("4");
 		cr4 |= (1 << 18); // Enable XSAVE and x{get, set}bv
 		write_cr("4", cr4);
@@ -177,19 +258,20 @@ static void cpu_init(struct stivale2_smp_info *smp_info) {
 		xcr0 |= (1 << 0); // Save x87 state with xsave
 		xcr0 |= (1 << 1); // Save SSE state with xsave
 
-		if ((c & bit_AVX))
+		if (cpu_has(CPU_FEATURE_AVX))
 			xcr0 |= (1 << 2); // Enable AVX and save AVX state with xsave
 
-		if (__get_cpuid(7, &a, &b, &c, &d)) {
-			if ((b & bit_AVX512F)) {
-				xcr0 |= (1 << 5); // Enable AVX-512
-				xcr0 |= (1 << 6); // Enable management of ZMM{0 -> 15}
-				xcr0 |= (1 << 7); // Enable management of ZMM{16 -> 31}
-			}
+		if (cpu_has(CPU_FEATURE_AVX512F)) {
+			xcr0 |= (1 << 5); // Enable AVX-512
+			xcr0 |= (1 << 6); // Enable management of ZMM{0 -> 15}
+			xcr0 |= (1 << 7); // Enable management of ZMM{16 -> 31}
 		}
 		wrxcr(0, xcr0);
 
-		this_cpu->fpu_storage_size = (size_t)c;
+		// Size of the XSAVE area for the features enabled in XCR0
+		uint32_t a = 0, b = 0, c = 0, d = 0;
+		__get_cpuid_count(0xD, 0, &a, &b, &c, &d);
+		this_cpu->fpu_storage_size = (size_t)b;
 
 		this_cpu->fpu_save = xsave;
 		this_cpu->fpu_restore = xrstor;
@@ -202,10 +284,11 @@ static void cpu_init(struct stivale2_smp_info *smp_info) {
 	memset(this_cpu->cpu_state, 0, sizeof(struct cpu_state));
 	cpu_count++;
 	UNLOCK(cpu_lock);
-	if (this_cpu->lapic_id != bsp_lapic_id) {
+	if (this_cpu->lapic_id != bsp_lapic_id)
 		lapic_init(this_cpu->lapic_id);
+	vmm_cpu_online();
+	if (this_cpu->lapic_id != bsp_lapic_id)
 		sched_init();
-	}
 }
 
 uint64_t return_installed_cpus(void) {
@@ -18,6 +18,11 @@
  * limitations under the License.
  */
 
+#include "../klibc/alloc.h"
+#include "../klibc/lock.h"
+#include "../mm/kstack.h"
+#include "../mm/pmm.h"
+#include "../mm/vmm.h"
 #include "../sched/scheduler.h"
 #include "../sys/gdt.h"
 #include <stdbool.h>
@@ -25,19 +30,59 @@
 #include <stdint.h>
 #include <stivale2.h>
 
+// CPUID registers holding feature bits, read once per CPU at boot
+enum cpuid_word {
+	CPUID_1_ECX,
+	CPUID_1_EDX,
+	CPUID_7_EBX,
+	CPUID_7_ECX,
+	CPUID_7_EDX,
+	CPUID_80000001_ECX,
+	CPUID_80000001_EDX,
+	CPUID_80000007_EDX,
+	CPUID_WORDS
+};
+
+struct cpu_features {
+	uint32_t words[CPUID_WORDS];
+};
+
+// Vector of the IPI asking a CPU to run a function, see smp_call()
+#define CPU_CALL_VECTOR 252
+
 struct cpu_local {
 	uint64_t cpu_number;
 	uint64_t kernel_stack;
 	uint32_t lapic_id;
+	size_t numa_node;
 	uint64_t tsc_frequency;
 	size_t fpu_storage_size;
 	struct tss cpu_tss;
 	void (*fpu_save)(void *);
 	void (*fpu_restore)(void *);
 	struct cpu_state *cpu_state;
+	// Stack of a thread that exited on this CPU, freed by the scheduler once
+	// it switched away from it
+	void *exited_stack;
+	struct pagemap *pagemap;
+	// Set by a CPU waiting for this one to flush its TLB
+	volatile bool tlb_shootdown;
+	// Page map owning each PCID on this CPU, NULL if PCIDs aren't used
+	struct pagemap **pcid_owners;
+	uint16_t pcid_next;
+	// PCIDs whose entries must be flushed when next loaded
+	uint64_t pcid_stale[VMM_PCID_COUNT / 64];
+	struct pmm_cache pmm_cache;
+	struct kstack_cache kstack_cache;
+	struct alloc_cache alloc_cache;
+	// Function smp_call() asked this CPU to run, NULL once it started
+	void (*volatile call_func)(void *);
+	void *call_arg;
 };
 
 extern struct cpu_local *cpu_locals;
+// The BSP's features, cpu_init() checks every CPU has them
+extern struct cpu_features cpu_features;
 
 #define this_cpu                                \
 	({                                          \
@@ -54,7 +99,9 @@ void wrmsr(uint32_t msr, uint64_t value);
 uint64_t return_bsp_lapic(void);
 uint64_t return_installed_cpus(void);
 void smp_init(struct stivale2_struct_tag_smp *smp_tag);
+bool smp_call(size_t cpu, void (*func)(void *), void *arg);
 void wsmp_cpu_init(void);
+void cpu_features_init(struct cpu_features *features);
 
 #define write_cr(reg, val) \
 	asm volatile("mov cr" reg ", %0" ::"r"(val) : "memory");
@@ -66,12 +113,57 @@ void wsmp_cpu_init(void);
 		cr;                                                  \
 	})
 
-#define CPUID_INVARIANT_TSC (1 << 8)
-#define CPUID_TSC_DEADLINE (1 << 24)
-#define CPUID_SMEP (1 << 7)
-#define CPUID_SMAP (1 << 20)
-#define CPUID_UMIP (1 << 2)
-#define CPUID_X2APIC (1 << 21)
-#define CPUID_GBPAGE (1 << 26)
+static inline uint64_t rdtsc(void) {
+	uint32_t edx, eax;
+	asm volatile("rdtsc" : "=a"(eax), "=d"(edx));
+	return ((uint64_t)edx << 32) | eax;
+}
+
+// Disables interrupts, returning whether they were enabled before
+static inline bool interrupts_save(void) {
+	uint64_t rflags;
+	asm volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags) : : "memory");
+	return rflags & (1 << 9);
+}
+
+static inline void interrupts_restore(bool enabled) {
+	if (enabled)
+		asm volatile("sti" : : : "memory");
+}
+
+// For locks also taken with interrupts off, e.g. from the page fault handler:
+// a holder preempted by the timer would leave them spinning forever
+static inline bool lock_irqsave(lock_t *lock) {
+	bool ints = interrupts_save();
+	LOCK(*lock);
+	return ints;
+}
+
+static inline void unlock_irqrestore(lock_t *lock, bool ints) {
+	UNLOCK(*lock);
+	interrupts_restore(ints);
+}
+
+#define CPU_FEATURE(word, bit) ((word)*32 + (bit))
+#define CPU_FEATURE_PCID CPU_FEATURE(CPUID_1_ECX, 17)
+#define CPU_FEATURE_X2APIC CPU_FEATURE(CPUID_1_ECX, 21)
+#define CPU_FEATURE_TSC_DEADLINE CPU_FEATURE(CPUID_1_ECX, 24)
+#define CPU_FEATURE_XSAVE CPU_FEATURE(CPUID_1_ECX, 26)
+#define CPU_FEATURE_AVX CPU_FEATURE(CPUID_1_ECX, 28)
+#define CPU_FEATURE_RDRAND CPU_FEATURE(CPUID_1_ECX, 30)
+#define CPU_FEATURE_SMEP CPU_FEATURE(CPUID_7_EBX, 7)
+#define CPU_FEATURE_INVPCID CPU_FEATURE(CPUID_7_EBX, 10)
+#define CPU_FEATURE_AVX512F CPU_FEATURE(CPUID_7_EBX, 16)
+#define CPU_FEATURE_RDSEED CPU_FEATURE(CPUID_7_EBX, 18)
+#define CPU_FEATURE_SMAP CPU_FEATURE(CPUID_7_EBX, 20)
+#define CPU_FEATURE_UMIP CPU_FEATURE(CPUID_7_ECX, 2)
+#define CPU_FEATURE_GBPAGE CPU_FEATURE(CPUID_80000001_EDX, 26)
+#define CPU_FEATURE_INVARIANT_TSC CPU_FEATURE(CPUID_80000007_EDX, 8)
+
+// Cheap replacement for CPUID, which is serializing and exits to the
+// hypervisor in VMs
+static inline bool cpu_has(unsigned int feature) {
+	return cpu_features.words[feature / 32] & (1U << (feature % 32));
+}
 
 #endif
@@ -19,6 +19,7 @@
 #include "isr.h"
 #include "../kernel/panic.h"
 #include "../klibc/printf.h"
+#include "../mm/kstack.h"
 #include "../mm/vmm.h"
 #include "../sys/gdt.h"
 #include "apic.h"
@@ -26,9 +27,15 @@
 #include <liballoc.h>
 
 void isr_install(void) {
-	// Set up IST 1 for severe exceptions
+	// Set up IST 1 for severe exceptions, IST 2 for page faults; the BSP uses
+	// this TSS until smp_init() gives every CPU its own
 	struct tss *tss_desc = kmalloc(sizeof(struct tss));
-	tss_desc->ist1 = (uint64_t)kmalloc(32768) + 32768;
+	uint8_t *ist1 = kstack_alloc("boot IST 1 of CPU", 0);
+	uint8_t *ist2 = kstack_alloc("boot IST 2 of CPU", 0);
+	if (tss_desc == NULL || ist1 == NULL || ist2 == NULL)
+		PANIC("Failed to allocate the boot TSS");
+	tss_desc->ist1 = (uint64_t)ist1 + KSTACK_SIZE;
+	tss_desc->ist2 = (uint64_t)ist2 + KSTACK_SIZE;
 	gdt_load_tss((size_t)tss_desc);
 	// Set up ISR handlers
 	set_idt_gate(0, isr0, 0);
@@ -45,7 +52,9 @@ void isr_install(void) {
 	set_idt_gate(11, isr11, 0);
 	set_idt_gate(12, isr12, 0);
 	set_idt_gate(13, isr13, 0);
-	set_idt_gate(14, isr14, 0);
+	// A page fault can hit a thread stack that isn't mapped or writable yet,
+	// so it can't push its frame there. It must not fault itself
+	set_idt_gate(14, isr14, 2);
 	set_idt_gate(15, isr15, 0);
 	set_idt_gate(16, isr16, 0);
 	set_idt_gate(17, isr17, 0);
@@ -328,10 +337,32 @@ static const char *exceptionMessages[] = {"Divide by zero",
 
 static eventHandlers_t eventHandlers[256] = {NULL};
 
+// Runs on IST 1, so it still has a stack when the one an exception was
+// delivered on overflowed into its guard page
+static void double_fault_handler(registers_t *r) {
+	uint64_t cr2 = 0;
+	asm("mov %0, cr2" : "=r"(cr2));
+	uint64_t id = 0;
+	const char *owner = kstack_guard_owner(cr2, &id);
+	if (owner == NULL)
+		owner = kstack_guard_owner(r->rsp, &id);
+	if (owner == NULL)
+		PANIC("System Service Exception Not Handled: Double fault");
+	char x[128];
+	snprintf(x, sizeof(x), "Double fault, kernel stack overflow: %s %llu",
+			 owner, id);
+	PANIC(x);
+}
+
 void isr_handler(registers_t *r) {
 	if (r->isrNumber < 32) {
-		if (r->isrNumber == 14)
+		// Returns only when the fault was resolved
+		if (r->isrNumber == 14) {
 			vmm_page_fault_handler(r);
+			return;
+		}
+		if (r->isrNumber == 8)
+			double_fault_handler(r);
 		char x[72];
 		sprintf(x, "System Service Exception Not Handled: %s",
 				exceptionMessages[r->isrNumber]);
@@ -15,10 +15,10 @@
  */
 
 #include "syscall.h"
+#include "../kernel/panic.h"
 #include "../klibc/printf.h"
 #include "cpu.h"
 #include "reg.h"
-#include <liballoc.h>
 #include <stdint.h>
 
 extern void syscall_handle(void);
@@ -56,6 +56,9 @@ void syscall_init(void) {
 	wrmsr(0xC0000082, (uint64_t)syscall_handle);
 	wrmsr(0xC0000084, (1 << 9));
 
-	uint8_t *cpu_stack = kmalloc(KSTACK_SIZE);
+	uint8_t *cpu_stack =
+		kstack_alloc("syscall stack of CPU", this_cpu->cpu_number);
+	if (cpu_stack == NULL)
+		PANIC("Failed to allocate syscall stack");
 	this_cpu->kernel_stack = (uintptr_t)cpu_stack + KSTACK_SIZE;
 }
@@ -15,26 +15,38 @@
  */
 
 #include "tmpfs.h"
+#include "../cpu/cpu.h"
 #include "../klibc/lock.h"
 #include "../klibc/mem.h"
+#include "../klibc/math.h"
 #include "../klibc/resource.h"
+#include "../mm/pmm.h"
+#include "../mm/slab.h"
+#include "../mm/vmm.h"
 #include "vfs.h"
 #include <liballoc.h>
 #include <stddef.h>
 
 struct tmpfs_resource {
 	struct resource res;
-	size_t allocated_size;
-	char *data;
+	// Physical pages holding the data, so they can be mapped as they are.
+	// NULL entries are holes, which read as zeros
+	void **pages;
+	size_t page_count;
 };
 
 struct tmpfs_mount_data {
 	ino_t inode_counter;
 };
 
+static struct kmem_cache *resource_cache = NULL;
+
 static struct vfs_node *tmpfs_mount(struct resource *device) {
 	(void)device;
-	struct vfs_node *mount_gate = kmalloc(sizeof(struct vfs_node));
+	if (resource_cache == NULL)
+		resource_cache = kmem_cache_create(
+			"tmpfs_resource", sizeof(struct tmpfs_resource), 0, NULL);
+	struct vfs_node *mount_gate = vfs_alloc_node();
 	mount_gate->fs = &tmpfs;
 	struct tmpfs_mount_data *mount_data =
 		kmalloc(sizeof(struct tmpfs_mount_data));
@@ -43,17 +55,65 @@ static struct vfs_node *tmpfs_mount(struct resource *device) {
 	return mount_gate;
 }
 
+// Returns the page holding "off", allocating it if "alloc" is set. Called
+// with the resource's lock held
+static void *tmpfs_page(struct tmpfs_resource *this, off_t off, bool alloc) {
+	size_t index = off / PAGE_SIZE;
+	if (index >= this->page_count) {
+		if (!alloc)
+			return NULL;
+		size_t count = MAX(this->page_count * 2, index + 1);
+		void **pages = krealloc(this->pages, count * sizeof(void *));
+		if (pages == NULL)
+			return NULL;
+		memset(pages + this->page_count, 0,
+			   (count - this->page_count) * sizeof(void *));
+		this->pages = pages;
+		this->page_count = count;
+	}
+	if (this->pages[index] == NULL && alloc) {
+		this->pages[index] = pmm_allocz(1);
+		if (this->pages[index] != NULL)
+			pmm_set_type(this->pages[index], 1, PAGE_TYPE_USER);
+	}
+	return this->pages[index];
+}
+
+// Same as tmpfs_page(), but takes the lock and a reference to the page. Reads
+// and writes copy with the lock dropped: the buffer may map this file, and
+// the fault on it takes the lock too
+static void *tmpfs_get_page(struct tmpfs_resource *this, off_t off,
+							bool alloc) {
+	bool ints = lock_irqsave(&this->res.lock);
+	void *page = tmpfs_page(this, off, alloc);
+	if (page != NULL)
+		pmm_get(page);
+	unlock_irqrestore(&this->res.lock, ints);
+	return page;
+}
+
 static ssize_t tmpfs_read(struct resource *_this, void *buf, off_t off,
 						  size_t count) {
 	struct tmpfs_resource *this = (void *)_this;
-	LOCK(this->res.lock);
-
-	if (off + count > (size_t)this->res.st.st_size)
-		count -= (off + count) - this->res.st.st_size;
-
-	memcpy(buf, this->data + off, count);
-
-	UNLOCK(this->res.lock);
+	bool ints = lock_irqsave(&this->res.lock);
+	if (off >= this->res.st.st_size)
+		count = 0;
+	else if (off + count > (size_t)this->res.st.st_size)
+		count = this->res.st.st_size - off;
+	unlock_irqrestore(&this->res.lock, ints);
+
+	for (size_t done = 0; done < count;) {
+		size_t page_off = (off + done) % PAGE_SIZE;
+		size_t chunk = MIN(PAGE_SIZE - page_off, count - done);
+		void *page = tmpfs_get_page(this, off + done, false);
+		if (page == NULL)
+			memset(buf + done, 0, chunk);
+		else {
+			memcpy(buf + done, page + MEM_PHYS_OFFSET + page_off, chunk);
+			pmm_put(page, 1);
+		}
+		done += chunk;
+	}
 
 	return count;
 }
@@ -61,24 +121,61 @@ static ssize_t tmpfs_read(struct resource *_this, void *buf, off_t off,
 static ssize_t tmpfs_write(struct resource *_this, const void *buf, off_t off,
 						   size_t count) {
 	struct tmpfs_resource *this = (void *)_this;
-	LOCK(this->res.lock);
-	if (off + count > this->allocated_size) {
-		while (off + count > this->allocated_size)
-			this->allocated_size *= 2;
+	if (count == 0)
+		return 0;
+	size_t done = 0;
+	while (done < count) {
+		size_t page_off = (off + done) % PAGE_SIZE;
+		size_t chunk = MIN(PAGE_SIZE - page_off, count - done);
+		void *page = tmpfs_get_page(this, off + done, true);
+		if (page == NULL)
+			break;
+		memcpy(page + MEM_PHYS_OFFSET + page_off, buf + done, chunk);
+		pmm_put(page, 1);
+		done += chunk;
+	}
+	bool ints = lock_irqsave(&this->res.lock);
+	if (off + done > (size_t)this->res.st.st_size)
+		this->res.st.st_size = off + done;
+	unlock_irqrestore(&this->res.lock, ints);
+	return done ? (ssize_t)done : -1;
+}
 
-		this->data = krealloc(this->data, this->allocated_size);
+// Called from the page fault handler, with interrupts off
+static void *tmpfs_mmap(struct resource *_this, off_t offset) {
+	struct tmpfs_resource *this = (void *)_this;
+	bool ints = lock_irqsave(&this->res.lock);
+	void *page = NULL;
+	// Pages past the end of the file can't be mapped, the last one can
+	if (offset >= 0 &&
+		(size_t)offset < ALIGN_UP((size_t)this->res.st.st_size, PAGE_SIZE)) {
+		page = tmpfs_page(this, offset, true);
+		if (page != NULL)
+			pmm_get(page);
 	}
-	memcpy(this->data + off, buf, count);
-	this->res.st.st_size += count;
-	UNLOCK(this->res.lock);
-	return count;
+	unlock_irqrestore(&this->res.lock, ints);
+	return page;
 }
 
+// Frees a file nothing references anymore, its pages stay allocated for as
+// long as a page map still maps them
+static void tmpfs_free(struct tmpfs_resource *this) {
+	for (size_t i = 0; i < this->page_count; i++)
+		if (this->pages[i] != NULL)
+			pmm_put(this->pages[i], 1);
+	kfree(this->pages);
+	kmem_cache_free(resource_cache, this);
+}
+
+// The file's link in the tree counts as a reference too: its data only lives
+// here, so it goes with the last close once it's no longer linked
 static int tmpfs_close(struct resource *_this) {
 	struct tmpfs_resource *this = (void *)_this;
-	LOCK(this->res.lock);
-	this->res.refcount--;
-	UNLOCK(this->res.lock);
+	bool ints = lock_irqsave(&this->res.lock);
+	bool last = --this->res.refcount == 0 && this->res.st.st_nlink == 0;
+	unlock_irqrestore(&this->res.lock, ints);
+	if (last)
+		tmpfs_free(this);
 	return 0;
 }
 
@@ -88,20 +185,21 @@ static struct resource *tmpfs_open(struct vfs_node *node, bool create,
 		return NULL;
 
 	struct tmpfs_mount_data *mount_data = node->mount_data;
-	struct tmpfs_resource *res = resource_create(sizeof(struct tmpfs_resource));
+	struct tmpfs_resource *res = kmem_cache_alloc(resource_cache);
+	if (res == NULL)
+		return NULL;
 
-	res->allocated_size = 4096;
-	res->data = kmalloc(res->allocated_size);
+	// Freed files leave their fields behind, start over from a clean object
+	resource_init(&res->res, sizeof(struct tmpfs_resource));
+	res->res.close = tmpfs_close;
+	res->res.read = tmpfs_read;
+	res->res.write = tmpfs_write;
+	res->res.mmap = tmpfs_mmap;
 	res->res.st.st_dev = node->backing_dev_id;
-	res->res.st.st_size = 0;
-	res->res.st.st_blocks = 0;
 	res->res.st.st_blksize = 512;
 	res->res.st.st_ino = mount_data->inode_counter++;
 	res->res.st.st_mode = (mode & ~S_IFMT) | S_IFREG;
 	res->res.st.st_nlink = 1;
-	res->res.close = tmpfs_close;
-	res->res.read = tmpfs_read;
-	res->res.write = tmpfs_write;
 
 	return (void *)res;
 }
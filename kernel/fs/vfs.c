@@ -15,11 +15,13 @@
  */
 
 #include "vfs.h"
+#include "../cpu/cpu.h"
 #include "../dev/dev.h"
 #include "../klibc/lock.h"
 #include "../klibc/printf.h"
 #include "../klibc/string.h"
 #include "../klibc/vec.h"
+#include "../mm/slab.h"
 #include <liballoc.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -31,9 +33,13 @@ filesystem_vec_t filesystems;
 
 bool initialized = false;
 
+static struct kmem_cache *node_cache;
+
 bool vfs_install_fs(struct filesystem *fs) {
 	if (initialized == false) {
 		vec_init(&filesystems);
+		node_cache = kmem_cache_create("vfs_node", sizeof(struct vfs_node), 0,
+									   NULL);
 		initialized = true;
 	}
 	vec_push(&filesystems, fs);
@@ -126,19 +132,11 @@ static struct vfs_node root_node = {.name = "/",
 									.backing_dev_id = 0};
 enum { NO_CREATE = 0, CREATE_SHALLOW, CREATE_DEEP };
 
-static struct vfs_node *path2node(struct vfs_node *parent, const char *_path,
+// Walks "path", a copy path2node() is free to write to
+static struct vfs_node *walk_path(struct vfs_node *parent, char *path,
 								  int create) {
 	bool last = false;
 
-	if (_path == NULL)
-		return NULL;
-
-	if (*_path == 0)
-		return NULL;
-
-	char *path = kmalloc(strlen(_path) + 1);
-	strcpy(path, _path);
-
 	// Get rid of trailing slashes
 	for (ssize_t i = strlen(path) - 1; i > 0; i--) {
 		if (path[i] == '/')
@@ -232,6 +230,25 @@ epilogue:
 	return NULL;
 }
 
+static struct vfs_node *path2node(struct vfs_node *parent, const char *_path,
+								  int create) {
+	if (_path == NULL)
+		return NULL;
+
+	if (*_path == 0)
+		return NULL;
+
+	// Paths vary in length, so the copy comes from kmalloc's size classes
+	// rather than a cache of its own
+	char *path = kmalloc(strlen(_path) + 1);
+	if (path == NULL)
+		return NULL;
+	strcpy(path, _path);
+	struct vfs_node *node = walk_path(parent, path, create);
+	kfree(path);
+	return node;
+}
+
 static struct filesystem *fstype2fs(const char *fstype) {
 	for (int i = 0; i < filesystems.length; i++) {
 		if (!strcmp(filesystems.data[i]->name, fstype))
@@ -315,6 +332,10 @@ struct vfs_node *vfs_mkdir(struct vfs_node *parent, const char *name,
 	return new_dir;
 }
 
+struct vfs_node *vfs_alloc_node(void) {
+	return kmem_cache_zalloc(node_cache);
+}
+
 struct vfs_node *vfs_new_node(struct vfs_node *parent, const char *name) {
 	if (parent == NULL)
 		parent = &root_node;
@@ -327,7 +348,9 @@ struct vfs_node *vfs_new_node(struct vfs_node *parent, const char *name) {
 	if (new_node != NULL)
 		return NULL;
 
-	new_node = kmalloc(sizeof(struct vfs_node));
+	new_node = vfs_alloc_node();
+	if (new_node == NULL)
+		return NULL;
 
 	new_node->next = parent->child;
 	parent->child = new_node;
@@ -373,15 +396,47 @@ struct resource *vfs_open(const char *path, int oflags, mode_t mode) {
 
 	struct resource *res = path_node->res;
 
-	LOCK(res->lock);
+	// Also taken by page faults on mappings of the file
+	bool ints = lock_irqsave(&res->lock);
 	res->refcount++;
-	UNLOCK(res->lock);
+	unlock_irqrestore(&res->lock, ints);
 
 	UNLOCK(vfs_lock);
 
 	return res;
 }
 
+// Removes the regular file at "path" from the tree. Its filesystem frees it
+// on the last close once it has no link left, right away if it isn't open
+bool vfs_unlink(const char *path) {
+	LOCK(vfs_lock);
+
+	struct vfs_node *node = path2node(NULL, path, NO_CREATE);
+	if (node == NULL || node->res == NULL ||
+		!S_ISREG(node->res->st.st_mode)) {
+		UNLOCK(vfs_lock);
+		return false;
+	}
+
+	struct vfs_node **link = &node->parent->child;
+	while (*link != node)
+		link = &(*link)->next;
+	*link = node->next;
+
+	// Closed like an open file would be, the close sees the link is gone
+	struct resource *res = node->res;
+	bool ints = lock_irqsave(&res->lock);
+	res->refcount++;
+	res->st.st_nlink--;
+	unlock_irqrestore(&res->lock, ints);
+
+	UNLOCK(vfs_lock);
+
+	res->close(res);
+	kmem_cache_free(node_cache, node);
+	return true;
+}
+
 void vfs_dump_nodes(struct vfs_node *node, const char *parent) {
 	struct vfs_node *cur_node = node ? node : &root_node;
 	for (; cur_node; cur_node = cur_node->next) {
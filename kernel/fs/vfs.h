@@ -48,6 +48,7 @@ struct vfs_node {
 	struct vfs_node *next;
 };
 
+struct vfs_node *vfs_alloc_node(void);
 struct vfs_node *vfs_new_node(struct vfs_node *parent, const char *name);
 struct vfs_node *vfs_new_node_deep(struct vfs_node *parent, const char *name);
 void vfs_dump_nodes(struct vfs_node *node, const char *parent);
@@ -57,6 +58,7 @@ bool vfs_mount(const char *source, const char *target, const char *fs);
 struct vfs_node *vfs_mkdir(struct vfs_node *parent, const char *name,
 						   mode_t mode, bool recurse);
 struct resource *vfs_open(const char *path, int oflags, mode_t mode);
+bool vfs_unlink(const char *path);
 bool vfs_stat(const char *path, struct stat *st);
 
 #endif
@@ -0,0 +1,475 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.h"
+#include "../cpu/cpu.h"
+#include "../fs/vfs.h"
+#include "../klibc/alloc.h"
+#include "../klibc/mem.h"
+#include "../klibc/printf.h"
+#include "../klibc/resource.h"
+#include "../mm/pmm.h"
+#include "../mm/slab.h"
+#include "../mm/vmm.h"
+#include "../sys/hpet.h"
+#include "../video/video.h"
+#include <liballoc.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_MAX_ROUNDS 1024
+
+static void *bench_ptrs[BENCH_MAX_ROUNDS];
+
+static uint64_t per_second(size_t ops, uint64_t ns) {
+	if (ns == 0)
+		ns = 1;
+	return (uint64_t)ops * 1000000000 / ns;
+}
+
+static void bench_pmm_alloc(size_t pages, size_t rounds) {
+	size_t done = 0;
+	uint64_t start = hpet_get_ns();
+	for (size_t i = 0; i < rounds; i++) {
+		bench_ptrs[i] = pmm_alloc(pages);
+		if (bench_ptrs[i] != NULL)
+			done++;
+	}
+	uint64_t elapsed = hpet_get_ns() - start;
+
+	for (size_t i = 0; i < rounds; i++)
+		if (bench_ptrs[i] != NULL)
+			pmm_free(bench_ptrs[i], pages);
+
+	printf("Bench: pmm_alloc(%zu): %llu allocs/s (%zu/%zu succeeded)\n", pages,
+		   per_second(done, elapsed), done, rounds);
+}
+
+static void bench_pmm(void) {
+	// Fragment memory first, a linear scan degrades once holes appear
+	for (size_t i = 0; i < BENCH_MAX_ROUNDS; i++)
+		bench_ptrs[i] = pmm_alloc(1);
+	for (size_t i = 0; i < BENCH_MAX_ROUNDS; i += 2)
+		if (bench_ptrs[i] != NULL)
+			pmm_free(bench_ptrs[i], 1);
+	static void *holes[BENCH_MAX_ROUNDS / 2];
+	for (size_t i = 1; i < BENCH_MAX_ROUNDS; i += 2)
+		holes[i / 2] = bench_ptrs[i];
+
+	bench_pmm_alloc(1, BENCH_MAX_ROUNDS);
+	bench_pmm_alloc(8, BENCH_MAX_ROUNDS);
+	// 512 pages (2MB) at a time, keep it within a 512MB guest
+	bench_pmm_alloc(512, 64);
+
+	for (size_t i = 0; i < BENCH_MAX_ROUNDS / 2; i++)
+		if (holes[i] != NULL)
+			pmm_free(holes[i], 1);
+}
+
+static void bench_numa(void) {
+	uint64_t local, remote;
+	pmm_numa_stats(&local, &remote);
+	uint64_t total = local + remote ? local + remote : 1;
+	printf("Bench: NUMA: %zu nodes, %llu local / %llu remote allocations "
+		   "(%llu%% local)\n",
+		   pmm_node_count, local, remote, local * 100 / total);
+
+	// Touching memory of each node from here shows what a remote
+	// allocation costs, run with "make run-numa"
+	for (size_t node = 0; node < pmm_node_count; node++) {
+		void *pages = pmm_alloc_node(64, node);
+		if (pages == NULL)
+			continue;
+		uint64_t start = hpet_get_ns();
+		for (size_t i = 0; i < 16; i++)
+			memset(pages + MEM_PHYS_OFFSET, (int)i, 64 * PAGE_SIZE);
+		uint64_t elapsed = hpet_get_ns() - start;
+		pmm_free(pages, 64);
+		printf("Bench: NUMA: Writing 4MB to node %zu took %llu ns\n", node,
+			   elapsed);
+	}
+}
+
+static void bench_vmm(void) {
+	// A scratch page map that's never loaded
+	struct pagemap *pagemap = vmm_new_pagemap();
+	if (pagemap->top_level == NULL)
+		return;
+	// Map 64MB with 4KB pages both ways, the physical address isn't 2MB
+	// aligned so vmm_map_range() can't use large pages either
+	size_t length = 64 * 1024 * 1024;
+	uint64_t start = rdtsc();
+	for (size_t p = 0; p < length; p += PAGE_SIZE)
+		vmm_map_page(pagemap, 0x100000000000 + p, PAGE_SIZE + p, 0b11, false,
+					 false);
+	uint64_t per_page = rdtsc() - start;
+	start = rdtsc();
+	vmm_map_range(pagemap, 0x200000000000, PAGE_SIZE, length, 0b11);
+	uint64_t range = rdtsc() - start;
+	start = rdtsc();
+	vmm_unmap_range(pagemap, 0x200000000000, length);
+	uint64_t unmap = rdtsc() - start;
+	printf("Bench: Mapping 64MB: %llu TSC cycles page by page, %llu as a "
+		   "range, unmapping it took %llu\n",
+		   per_page, range, unmap);
+	vmm_destroy_pagemap(pagemap);
+}
+
+// Reads a byte of each page, every one needs its own 4KB TLB entry
+static void bench_touch(volatile uint8_t *pages, size_t count) {
+	for (size_t i = 0; i < count; i++)
+		(void)pages[i * PAGE_SIZE];
+}
+
+static void bench_pcid(void) {
+	// 64 pages mapped with 4KB pages at the same lower half address of two
+	// page maps, unlike kernel mappings they aren't global
+	size_t count = 64;
+	uint64_t virt = 0x7F0000000000;
+	void *phys = pmm_alloc(count);
+	if (phys == NULL)
+		return;
+	struct pagemap *pagemap = vmm_new_pagemap();
+	if (pagemap->top_level != NULL &&
+		!vmm_map_range(kernel_pagemap, virt, (uint64_t)phys, count * PAGE_SIZE,
+					   0b11 | PTE_NX) &&
+		!vmm_map_range(pagemap, virt, (uint64_t)phys, count * PAGE_SIZE,
+					   0b11 | PTE_NX)) {
+		bool ints = interrupts_save();
+		uint64_t start = rdtsc();
+		for (size_t i = 0; i < 1000; i++) {
+			vmm_switch_pagemap(pagemap);
+			bench_touch((void *)virt, count);
+			vmm_switch_pagemap(kernel_pagemap);
+			bench_touch((void *)virt, count);
+		}
+		uint64_t switches = rdtsc() - start;
+		// CR3 writes flushing the TLB, what every switch did without PCIDs
+		uint64_t cr3 = read_cr("3");
+		start = rdtsc();
+		for (size_t i = 0; i < 1000; i++) {
+			write_cr("3", (uint64_t)pagemap->top_level);
+			bench_touch((void *)virt, count);
+			write_cr("3", cr3);
+			bench_touch((void *)virt, count);
+		}
+		uint64_t flushes = rdtsc() - start;
+		interrupts_restore(ints);
+		printf("Bench: 2000 page map switches touching 64 pages: %llu TSC "
+			   "cycles with vmm_switch_pagemap() (PCIDs %s), %llu "
+			   "flushing\n",
+			   switches, this_cpu->pcid_owners ? "on" : "off", flushes);
+	}
+	vmm_destroy_pagemap(pagemap);
+	vmm_unmap_range(kernel_pagemap, virt, count * PAGE_SIZE);
+	pmm_free(phys, count);
+}
+
+static void bench_fork(void) {
+	// Fork latency against resident memory, in scratch page maps: whole page
+	// tables are shared, so it grows with the number of tables rather than
+	// pages. From 4MB on, the areas get 2MB pages on the first touch, which
+	// are shared one by one and copied whole on the first write
+	uint64_t base = 0x100000000000;
+	for (size_t mb = 1; mb <= 64; mb *= 4) {
+		size_t length = mb * 1024 * 1024;
+		struct pagemap *pagemap = vmm_new_pagemap();
+		if (pagemap->top_level == NULL ||
+			vma_add(pagemap, base, length, 0b11 | PTE_NX, VMA_ANONYMOUS)) {
+			vmm_destroy_pagemap(pagemap);
+			return;
+		}
+		for (size_t p = 0; p < length; p += PAGE_SIZE)
+			vma_fault(pagemap, base + p, 0x2);
+		uint64_t start = rdtsc();
+		struct pagemap *child = vma_fork(pagemap);
+		uint64_t fork = rdtsc() - start;
+		if (child != NULL) {
+			// Unshares the page table, then copies the page
+			start = rdtsc();
+			vma_fault(child, base, 0x3);
+			uint64_t cow = rdtsc() - start;
+			printf("Bench: Forking %zuMB of resident memory: %llu TSC "
+				   "cycles, first write to a page after it %llu\n",
+				   mb, fork, cow);
+			vmm_destroy_pagemap(child);
+		}
+		vmm_destroy_pagemap(pagemap);
+	}
+}
+
+// Walks the pages in an order the prefetcher can't follow, "count" is a power
+// of 2
+static uint64_t bench_walk(volatile uint8_t *pages, size_t count) {
+	uint64_t start = rdtsc();
+	for (size_t round = 0; round < 16; round++)
+		for (size_t i = 0; i < count; i++)
+			(void)pages[(i * 4099 % count) * PAGE_SIZE];
+	return rdtsc() - start;
+}
+
+static void bench_thp(void) {
+	// 64MB populated with 4KB pages by hand, walked before and after the
+	// collapse pass turns them into 2MB pages
+	size_t count = 16384;
+	uint64_t base = 0x100000000000;
+	struct pagemap *pagemap = vmm_new_pagemap();
+	if (pagemap->top_level == NULL ||
+		vma_add(pagemap, base, count * PAGE_SIZE, 0b11 | PTE_NX,
+				VMA_ANONYMOUS)) {
+		vmm_destroy_pagemap(pagemap);
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		void *page = pmm_allocz(1);
+		if (page == NULL) {
+			vmm_destroy_pagemap(pagemap);
+			return;
+		}
+		pmm_set_type(page, 1, PAGE_TYPE_USER);
+		vmm_map_range(pagemap, base + i * PAGE_SIZE, (uint64_t)page, PAGE_SIZE,
+					  0b11 | PTE_NX);
+	}
+	bool ints = interrupts_save();
+	vmm_switch_pagemap(pagemap);
+	bench_walk((void *)base, count);
+	uint64_t small = bench_walk((void *)base, count);
+	vmm_switch_pagemap(kernel_pagemap);
+	interrupts_restore(ints);
+
+	size_t collapsed = vma_collapse(pagemap, count);
+
+	ints = interrupts_save();
+	vmm_switch_pagemap(pagemap);
+	bench_walk((void *)base, count);
+	uint64_t huge = bench_walk((void *)base, count);
+	vmm_switch_pagemap(kernel_pagemap);
+	interrupts_restore(ints);
+	printf("Bench: Walking 64MB: %llu TSC cycles with 4KB pages, %llu after "
+		   "collapsing %zu 2MB pages\n",
+		   small, huge, collapsed);
+	vmm_destroy_pagemap(pagemap);
+}
+
+static void bench_video(void) {
+	// The framebuffer uncached, as the firmware usually leaves it, then
+	// write-combining
+	uint64_t types[2] = {VMM_CACHE_UC, VMM_CACHE_WC};
+	uint64_t clear[2], scroll[2];
+	for (size_t i = 0; i < 2; i++) {
+		video_set_cache(types[i]);
+		uint64_t start = rdtsc();
+		clear_screen(0x000000);
+		clear[i] = rdtsc() - start;
+		start = rdtsc();
+		for (size_t j = 0; j < 1000; j++)
+			video_scroll();
+		scroll[i] = rdtsc() - start;
+	}
+	clear_screen(0x000000);
+	printf("Bench: Clearing the screen: %llu TSC cycles uncached, %llu "
+		   "write-combining\n",
+		   clear[0], clear[1]);
+	printf("Bench: Scrolling 1000 lines: %llu TSC cycles uncached, %llu "
+		   "write-combining\n",
+		   scroll[0], scroll[1]);
+}
+
+// About the size of a process or a file, allocated and freed in rounds as
+// processes come and go
+#define BENCH_OBJECT_SIZE 304
+
+static void bench_slab(void) {
+	struct kmem_cache *cache =
+		kmem_cache_create("bench", BENCH_OBJECT_SIZE, 0, NULL);
+	if (cache == NULL)
+		return;
+	uint64_t elapsed[2];
+	for (size_t pass = 0; pass < 2; pass++) {
+		uint64_t start = hpet_get_ns();
+		for (size_t round = 0; round < 8; round++) {
+			for (size_t i = 0; i < BENCH_MAX_ROUNDS; i++)
+				bench_ptrs[i] = pass ? kmem_cache_alloc(cache)
+									 : kmalloc(BENCH_OBJECT_SIZE);
+			for (size_t i = 0; i < BENCH_MAX_ROUNDS; i++) {
+				if (pass)
+					kmem_cache_free(cache, bench_ptrs[i]);
+				else
+					kfree(bench_ptrs[i]);
+			}
+		}
+		elapsed[pass] = hpet_get_ns() - start;
+	}
+	kmem_cache_destroy(cache);
+	printf("Bench: %u byte objects: %llu allocs/s with kmalloc, %llu with a "
+		   "slab cache\n",
+		   BENCH_OBJECT_SIZE, per_second(8 * BENCH_MAX_ROUNDS, elapsed[0]),
+		   per_second(8 * BENCH_MAX_ROUNDS, elapsed[1]));
+}
+
+// Files created, written and removed in turns, each one reuses the object the
+// one before it freed
+#define BENCH_FILES 256
+
+static void bench_tmpfs(void) {
+	void *buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL)
+		return;
+	memset(buf, 0xAA, PAGE_SIZE);
+	uint64_t start = hpet_get_ns();
+	size_t done = 0;
+	for (; done < BENCH_FILES; done++) {
+		struct resource *res = vfs_open("/bench", O_CREAT | O_RDWR, 0644);
+		if (res == NULL)
+			break;
+		if (res->st.st_size != 0) {
+			printf("Bench: New tmpfs file has the size of a freed one\n");
+			res->close(res);
+			vfs_unlink("/bench");
+			break;
+		}
+		res->write(res, buf, 0, PAGE_SIZE);
+		res->close(res);
+		if (!vfs_unlink("/bench"))
+			break;
+	}
+	uint64_t elapsed = hpet_get_ns() - start;
+	kfree(buf);
+	printf("Bench: Creating, writing and removing a 4KB tmpfs file: %llu "
+		   "files/s\n",
+		   per_second(done, elapsed));
+}
+
+// kmalloc() on several CPUs at once. The other CPUs run their part from an
+// IPI, the scheduler runs one thread at a time
+#define BENCH_SMP_ROUNDS 256
+#define BENCH_SMP_BATCH 32
+
+struct bench_worker {
+	size_t size;
+	volatile bool *start;
+	volatile size_t *ready;
+	volatile uint64_t elapsed;
+	volatile bool done;
+};
+
+static void bench_kmalloc_worker(void *arg) {
+	struct bench_worker *worker = arg;
+	void *ptrs[BENCH_SMP_BATCH];
+	__sync_fetch_and_add(worker->ready, 1);
+	while (!*worker->start)
+		asm volatile("pause");
+	uint64_t start = hpet_get_ns();
+	for (size_t round = 0; round < BENCH_SMP_ROUNDS; round++) {
+		for (size_t i = 0; i < BENCH_SMP_BATCH; i++)
+			ptrs[i] = kmalloc(worker->size);
+		for (size_t i = 0; i < BENCH_SMP_BATCH; i++)
+			kfree(ptrs[i]);
+	}
+	worker->elapsed = hpet_get_ns() - start;
+	worker->done = true;
+}
+
+static void bench_kmalloc_smp(size_t size) {
+	size_t cpus = return_installed_cpus();
+	struct bench_worker *workers = kcalloc(cpus, sizeof(struct bench_worker));
+	if (workers == NULL)
+		return;
+	size_t self = this_cpu->cpu_number;
+	for (size_t count = 1;; count = count * 2 < cpus ? count * 2 : cpus) {
+		volatile bool start = false;
+		volatile size_t ready = 0;
+		size_t used = 0;
+		for (size_t cpu = 0; cpu < cpus && used + 1 < count; cpu++) {
+			if (cpu == self)
+				continue;
+			workers[used] = (struct bench_worker){
+				.size = size, .start = &start, .ready = &ready};
+			if (smp_call(cpu, bench_kmalloc_worker, &workers[used]))
+				used++;
+		}
+		while (ready < used)
+			asm volatile("pause");
+		workers[used] = (struct bench_worker){
+			.size = size, .start = &start, .ready = &ready};
+		start = true;
+		bench_kmalloc_worker(&workers[used]);
+		uint64_t elapsed = 0;
+		for (size_t i = 0; i <= used; i++) {
+			while (!workers[i].done)
+				asm volatile("pause");
+			if (workers[i].elapsed > elapsed)
+				elapsed = workers[i].elapsed;
+		}
+		printf("Bench: kmalloc(%zu) on %zu CPUs: %llu allocs/s\n", size,
+			   used + 1,
+			   per_second((used + 1) * BENCH_SMP_ROUNDS * BENCH_SMP_BATCH,
+						  elapsed));
+		if (count == cpus)
+			break;
+	}
+	kfree(workers);
+}
+
+// What the heap costs once the initramfs is loaded
+static void bench_heap(void) {
+	struct alloc_stats stats;
+	alloc_get_stats(&stats);
+	size_t overhead = stats.slab_bytes - stats.object_bytes;
+	printf("Bench: kmalloc() heap: %zu objects of %zu bytes in %zu bytes of "
+		   "slabs, %zu bytes (%llu%%) overhead of which %zu bytes are cached "
+		   "objects; %zu bytes of whole pages\n",
+		   stats.objects, stats.object_bytes, stats.slab_bytes, overhead,
+		   stats.slab_bytes ? (uint64_t)overhead * 100 / stats.slab_bytes : 0,
+		   stats.cached_bytes, stats.large_bytes);
+}
+
+void bench_run(void) {
+	printf("Bench: Running boot-time benchmarks\n");
+	// Boot with a large -m (e.g. 16G) to see how this scales with memory
+	printf("Bench: pmm_init took %llu TSC cycles\n", pmm_init_cycles);
+	printf("Bench: vmm_init took %llu TSC cycles\n", vmm_init_cycles);
+	bench_pmm();
+	bench_numa();
+	bench_vmm();
+	bench_pcid();
+	bench_fork();
+	bench_thp();
+	bench_video();
+	bench_slab();
+	bench_tmpfs();
+	// Served by the CPU's magazines, then by the slab cache of the class
+	bench_kmalloc_smp(64);
+	bench_kmalloc_smp(1024);
+	bench_heap();
+	printf("Bench: 2MB pages: %llu mapped on a fault, %llu collapsed\n",
+		   vma_huge_faults, vma_huge_collapses);
+	printf("Bench: Zeroed page pool: %llu hits, %llu misses\n",
+		   pmm_zero_pool_hits, pmm_zero_pool_misses);
+	struct pmm_stats stats;
+	pmm_get_stats(&stats);
+	printf("Bench: Pages: %zu free, %zu cached, %zu used, %zu reserved "
+		   "(watermarks %zu/%zu/%zu)\n",
+		   stats.free, stats.cached, stats.used, stats.reserved,
+		   pmm_watermarks.min, pmm_watermarks.low, pmm_watermarks.high);
+	printf("Bench: Pages in use: %llu reserved, %llu kernel, %llu page tables, "
+		   "%llu heap, %llu user\n",
+		   pmm_page_type_counts[PAGE_TYPE_RESERVED],
+		   pmm_page_type_counts[PAGE_TYPE_KERNEL],
+		   pmm_page_type_counts[PAGE_TYPE_PAGE_TABLE],
+		   pmm_page_type_counts[PAGE_TYPE_HEAP],
+		   pmm_page_type_counts[PAGE_TYPE_USER]);
+}
@@ -25,9 +25,12 @@
 #include "../fs/devtmpfs.h"
 #include "../fs/tmpfs.h"
 #include "../fs/vfs.h"
+#include "../klibc/alloc.h"
 #include "../klibc/printf.h"
 #include "../klibc/resource.h"
+#include "../mm/kstack.h"
 #include "../mm/pmm.h"
+#include "../mm/vmalloc.h"
 #include "../mm/vmm.h"
 #include "../sched/process.h"
 #include "../sched/scheduler.h"
@@ -35,6 +38,7 @@
 #include "../sys/elf.h"
 #include "../sys/gdt.h"
 #include "../video/video.h"
+#include "bench.h"
 #include "panic.h"
 #include <liballoc.h>
 #include <stdint.h>
@@ -59,6 +63,36 @@ __attribute__((section(".stivale2hdr"),
 	.flags = (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4),
 	.tags = (uintptr_t)&framebuffer_hdr_tag};
 
+#ifdef HEAP_TRACKING
+// Characters received over the serial port, see HEAP_TRACKING in the makefile
+static void heap_command(char c) {
+	if (c == 'h')
+		alloc_track_dump();
+	else if (c == 'm')
+		alloc_track_mark();
+}
+#endif
+
+#ifdef BENCHMARKS
+// Run as a process of its own: the fork has to return in both copies, each
+// with the stack as it was
+static void fork_test(void) {
+	volatile uint64_t marker = 0xF0F0;
+	uint32_t pid = process_fork(2);
+	if (marker != 0xF0F0)
+		PANIC("Fork test: stack changed across the fork");
+	if (pid == 0) {
+		marker = 0;
+		printf("Fork test: returned in the child\n");
+	} else if (pid == (uint32_t)-1)
+		printf("Fork test: fork failed\n");
+	else
+		printf("Fork test: returned in the parent, child PID %u\n", pid);
+	for (;;)
+		asm("hlt");
+}
+#endif
+
 void *stivale2_get_tag(struct stivale2_struct *stivale2_struct, uint64_t id) {
 	struct stivale2_tag *current_tag = (void *)stivale2_struct->tags;
 	for (;;) {
@@ -96,18 +130,25 @@ void kernel_main(struct stivale2_struct *stivale2_struct) {
 	struct stivale2_struct_tag_modules *modules_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_MODULES_ID);
 	initramfs_init(modules_tag);
+	// The stivale2 struct isn't used past this point
+	pmm_reclaim();
 	struct resource *res = vfs_open("/root/initramfs.txt", O_RDONLY, 0644);
 	struct stat *st = kmalloc(sizeof(struct stat));
 	vfs_stat("/root/initramfs.txt", st);
 	char *buf = kmalloc(st->st_size);
 	res->read(res, buf, 0, st->st_size);
 	printf("Reading /root/initramfs.txt: %s\n", buf);
+#ifdef BENCHMARKS
+	bench_run();
+	process_create("fork_test", (uintptr_t)fork_test, 0, NORMAL);
+#endif
 	load_elf("/root/test");
 	for (;;)
 		asm("hlt");
 }
 
 void _start(struct stivale2_struct *stivale2_struct) {
+	cpu_features_init(&cpu_features);
 	gdt_init();
 	struct stivale2_struct_tag_framebuffer *fb_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_FRAMEBUFFER_ID);
@@ -115,6 +156,7 @@ void _start(struct stivale2_struct *stivale2_struct) {
 	struct stivale2_struct_tag_memmap *memmap_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_MEMMAP_ID);
 	pmm_init((void *)memmap_tag->memmap, memmap_tag->entries);
+	alloc_init();
 	struct stivale2_struct_tag_pmrs *pmrs_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_PMRS_ID);
 	struct stivale2_struct_tag_kernel_base_address *kernel_base_tag =
@@ -124,21 +166,30 @@ void _start(struct stivale2_struct *stivale2_struct) {
 			 (void *)pmrs_tag->pmrs, pmrs_tag->entries,
 			 kernel_base_tag->virtual_base_address,
 			 kernel_base_tag->physical_base_address);
+	vmalloc_init();
 	serial_install();
 	printf("Kernel build: %s\n", KVERSION);
 	isr_install();
 	asm volatile("sti");
 	wsmp_cpu_init();
+	// The PAT has a write-combining entry now
+	video_set_cache(VMM_CACHE_WC);
 	struct stivale2_struct_tag_rsdp *rsdp_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_RSDP_ID);
 	acpi_init((void *)rsdp_tag->rsdp);
 	pic_init();
 	apic_init();
+#ifdef HEAP_TRACKING
+	serial_set_input_handler(heap_command);
+#endif
 	struct stivale2_struct_tag_smp *smp_tag =
 		stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_SMP_ID);
 	smp_init(smp_tag);
 	while (return_installed_cpus() != smp_tag->cpu_count)
 		;
+	pmm_enable_cpu_caches();
+	kstack_enable_cpu_caches();
+	alloc_enable_cpu_caches();
 	process_init((uintptr_t)kernel_main, (uint64_t)stivale2_struct);
 	sched_init();
 	for (;;)
@@ -16,60 +16,503 @@
  */
 
 #include "alloc.h"
+#include "../cpu/cpu.h"
+#include "../kernel/panic.h"
+#include "../kernel/symbols.h"
 #include "../mm/pmm.h"
+#include "../mm/slab.h"
 #include "../mm/vmm.h"
+#include "../serial/serial.h"
 #include "lock.h"
 #include "math.h"
+#include "mem.h"
+#include "printf.h"
+#include <liballoc.h>
 
-struct alloc_metadata {
-	size_t pages;
-	size_t size;
+static const char *class_names[ALLOC_CLASSES] = {
+	"kmalloc-8",   "kmalloc-16",  "kmalloc-32",	 "kmalloc-64",	"kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"};
+static struct kmem_cache *class_caches[ALLOC_CLASSES];
+// Pages of allocations above ALLOC_CLASS_MAX
+static size_t large_pages = 0;
+
+// Owner of the struct page of the first page of allocations above
+// ALLOC_CLASS_MAX, the size is in its "private" field
+static char large_owner;
+
+struct alloc_depot {
+	lock_t lock;
+	struct alloc_magazine *full;
+	size_t full_count;
+	struct alloc_magazine *empty;
+	size_t empty_count;
 };
 
-void *alloc(size_t size) {
-	size_t page_count = DIV_ROUNDUP(size, PAGE_SIZE);
+static struct alloc_depot depots[ALLOC_MAGAZINE_CLASSES];
+static struct kmem_cache *magazine_cache;
+static bool cpu_caches_enabled = false;
 
-	void *ptr = (char *)pmm_allocz(page_count + 1);
+static inline size_t class_size(size_t class) {
+	return ALLOC_CLASS_MIN << class;
+}
 
-	if (!ptr)
+static inline size_t size_class(size_t size) {
+	size_t class = 0;
+	while (class_size(class) < size)
+		class++;
+	return class;
+}
+
+// Called once the PMM is up, before anything is allocated
+void alloc_init(void) {
+	for (size_t class = 0; class < ALLOC_CLASSES; class++) {
+		size_t size = class_size(class);
+		// 16 bytes, the alignment of any type, for objects big enough
+		class_caches[class] = kmem_cache_create(class_names[class], size,
+												MIN(size, (size_t)16), NULL);
+		if (class_caches[class] == NULL)
+			PANIC("Failed to create the kmalloc() caches");
+	}
+}
+
+// Called once every CPU has its CPU local data loaded in gsbase
+void alloc_enable_cpu_caches(void) {
+	magazine_cache = kmem_cache_create(
+		"kmalloc magazine", sizeof(struct alloc_magazine), 0, NULL);
+	if (magazine_cache != NULL)
+		cpu_caches_enabled = true;
+}
+
+// Takes a full magazine from the depot in exchange for an empty one, NULL if
+// it has none
+static struct alloc_magazine *depot_get_full(size_t class,
+											 struct alloc_magazine *empty) {
+	struct alloc_depot *depot = &depots[class];
+	struct alloc_magazine *full = NULL;
+	LOCK(depot->lock);
+	if (depot->full != NULL) {
+		full = depot->full;
+		depot->full = full->next;
+		depot->full_count--;
+		if (empty != NULL && depot->empty_count < ALLOC_DEPOT_MAX) {
+			empty->next = depot->empty;
+			depot->empty = empty;
+			depot->empty_count++;
+			empty = NULL;
+		}
+	}
+	UNLOCK(depot->lock);
+	if (full != NULL && empty != NULL)
+		kmem_cache_free(magazine_cache, empty);
+	return full;
+}
+
+// Hands a full magazine, if any, to the depot and returns an empty one. NULL
+// if the depot has no room for it or no magazine could be allocated
+static struct alloc_magazine *depot_put_full(size_t class,
+											 struct alloc_magazine *full) {
+	struct alloc_depot *depot = &depots[class];
+	struct alloc_magazine *empty = NULL;
+	LOCK(depot->lock);
+	bool room = full == NULL || depot->full_count < ALLOC_DEPOT_MAX;
+	if (room && depot->empty != NULL) {
+		empty = depot->empty;
+		depot->empty = empty->next;
+		depot->empty_count--;
+		if (full != NULL) {
+			full->next = depot->full;
+			depot->full = full;
+			depot->full_count++;
+		}
+	}
+	UNLOCK(depot->lock);
+	if (!room)
 		return NULL;
 
-	ptr += MEM_PHYS_OFFSET;
+	if (empty == NULL) {
+		empty = kmem_cache_alloc(magazine_cache);
+		if (empty == NULL)
+			return NULL;
+		if (full != NULL) {
+			// The depot may have filled up while the lock was dropped
+			LOCK(depot->lock);
+			room = depot->full_count < ALLOC_DEPOT_MAX;
+			if (room) {
+				full->next = depot->full;
+				depot->full = full;
+				depot->full_count++;
+			}
+			UNLOCK(depot->lock);
+			if (!room) {
+				kmem_cache_free(magazine_cache, empty);
+				return NULL;
+			}
+		}
+	}
+	empty->count = 0;
+	return empty;
+}
 
-	struct alloc_metadata *metadata = ptr;
-	ptr += PAGE_SIZE;
+// Interrupts are off while the CPU's magazines are used, so nothing else
+// touches them
+static void *magazine_alloc(size_t class) {
+	void *object = NULL;
+	bool ints = interrupts_save();
+	struct alloc_cache *cache = &this_cpu->alloc_cache;
+	struct alloc_magazine *loaded = cache->loaded[class];
+	if (loaded == NULL || loaded->count == 0) {
+		struct alloc_magazine *previous = cache->previous[class];
+		if (previous != NULL && previous->count) {
+			cache->previous[class] = loaded;
+			cache->loaded[class] = loaded = previous;
+		} else {
+			// The loaded magazine, if any, goes to the depot in exchange
+			struct alloc_magazine *full = depot_get_full(class, loaded);
+			if (full != NULL)
+				cache->loaded[class] = loaded = full;
+		}
+	}
+	if (loaded != NULL && loaded->count)
+		object = loaded->objects[--loaded->count];
+	interrupts_restore(ints);
+	return object;
+}
 
-	metadata->pages = page_count;
-	metadata->size = size;
+// Returns false if there is no room for the object, it goes back to the heap
+static bool magazine_free(size_t class, void *object) {
+	bool ints = interrupts_save();
+	struct alloc_cache *cache = &this_cpu->alloc_cache;
+	struct alloc_magazine *loaded = cache->loaded[class];
+	if (loaded == NULL) {
+		loaded = depot_put_full(class, NULL);
+		cache->loaded[class] = loaded;
+	} else if (loaded->count == ALLOC_MAGAZINE_SIZE) {
+		struct alloc_magazine *previous = cache->previous[class];
+		if (previous != NULL && previous->count < ALLOC_MAGAZINE_SIZE) {
+			cache->previous[class] = loaded;
+			cache->loaded[class] = loaded = previous;
+		} else {
+			// Both are full, the previous one goes to the depot
+			struct alloc_magazine *empty = depot_put_full(class, previous);
+			if (empty != NULL) {
+				cache->previous[class] = loaded;
+				cache->loaded[class] = loaded = empty;
+			}
+		}
+	}
+	bool cached = loaded != NULL && loaded->count < ALLOC_MAGAZINE_SIZE;
+	if (cached)
+		loaded->objects[loaded->count++] = object;
+	interrupts_restore(ints);
+	return cached;
+}
 
-	return ptr;
+// The class of an object kmalloc() returned, ALLOC_CLASSES for the bigger
+// ones. Read from the struct page of its page, objects have no header
+static size_t object_class(void *ptr, struct page **page_out) {
+	struct page *page = phys_to_page((uintptr_t)ptr - MEM_PHYS_OFFSET);
+	if (page != NULL && page->type == PAGE_TYPE_HEAP) {
+		if (page->owner == &large_owner && (uintptr_t)ptr % PAGE_SIZE == 0) {
+			*page_out = page;
+			return ALLOC_CLASSES;
+		}
+		for (size_t class = 0; class < ALLOC_CLASSES; class++)
+			if (page->owner == class_caches[class])
+				return class;
+	}
+	PANIC("Freeing or resizing memory kmalloc() didn't return");
+	__builtin_unreachable();
 }
 
-void free(void *ptr) {
-	struct alloc_metadata *metadata = ptr - PAGE_SIZE;
+static void *heap_alloc(size_t size) {
+	if (size <= ALLOC_CLASS_MAX) {
+		size_t class = size_class(size);
+		if (class < ALLOC_MAGAZINE_CLASSES && cpu_caches_enabled) {
+			void *object = magazine_alloc(class);
+			if (object != NULL)
+				return object;
+		}
+		return kmem_cache_alloc(class_caches[class]);
+	}
 
-	pmm_free((void *)metadata - MEM_PHYS_OFFSET, metadata->pages + 1);
+	size_t pages = DIV_ROUNDUP(size, PAGE_SIZE);
+	void *phys = pmm_alloc(pages);
+	if (phys == NULL)
+		return NULL;
+	pmm_set_type(phys, pages, PAGE_TYPE_HEAP);
+	struct page *page = phys_to_page((uintptr_t)phys);
+	page->owner = &large_owner;
+	page->private = size;
+	__sync_fetch_and_add(&large_pages, pages);
+	return phys + MEM_PHYS_OFFSET;
 }
 
-void *liballoc_alloc(size_t size) {
-	return pmm_allocz(size) + MEM_PHYS_OFFSET;
+static void heap_free(void *ptr) {
+	struct page *page = NULL;
+	size_t class = object_class(ptr, &page);
+	if (class == ALLOC_CLASSES) {
+		size_t pages = DIV_ROUNDUP(page->private, PAGE_SIZE);
+		page->owner = NULL;
+		__sync_fetch_and_sub(&large_pages, pages);
+		pmm_free(ptr - MEM_PHYS_OFFSET, pages);
+		return;
+	}
+	if (class < ALLOC_MAGAZINE_CLASSES && cpu_caches_enabled &&
+		magazine_free(class, ptr))
+		return;
+	kmem_cache_free(class_caches[class], ptr);
 }
 
-int liballoc_free(void *ptr, size_t size) {
-	pmm_free(ptr - MEM_PHYS_OFFSET, size);
-	return 0;
+// Bytes that can be used at "ptr", at least what was asked for
+size_t kmalloc_usable_size(void *ptr) {
+	if (ptr == NULL)
+		return 0;
+	struct page *page = NULL;
+	size_t class = object_class(ptr, &page);
+	if (class == ALLOC_CLASSES)
+		return ALIGN_UP(page->private, PAGE_SIZE);
+	return class_size(class);
 }
 
-lock_t alloc_lock;
+#ifdef HEAP_TRACKING
+// Every object kmalloc() returned is recorded with the call site it was
+// allocated from, in tables that don't use the heap
+#define TRACK_SITES 512
+// A power of 2
+#define TRACK_OBJECTS 16384
+
+struct track_site {
+	uintptr_t caller;
+	size_t allocs;
+	size_t live;
+	size_t live_bytes;
+};
+
+struct track_object {
+	void *ptr;
+	uint32_t site;
+	// alloc_track_mark() calls before it was allocated
+	uint32_t generation;
+	size_t size;
+};
+
+static struct track_site track_sites[TRACK_SITES];
+static size_t track_site_count = 0;
+static struct track_object track_objects[TRACK_OBJECTS];
+static size_t track_object_count = 0;
+static uint32_t track_generation = 0;
+// Objects not recorded because a table was full
+static size_t track_dropped = 0;
+static lock_t track_lock;
+
+static inline size_t track_slot(void *ptr) {
+	return ((uintptr_t)ptr >> 3) * 0x9E3779B97F4A7C15 >> 50;
+}
 
-int liballoc_lock() {
-	LOCK(alloc_lock);
-	asm volatile("cli");
-	return 0;
+_Static_assert(TRACK_OBJECTS == 1 << (64 - 50), "track_slot() needs fixing");
+
+static struct track_object *track_find(void *ptr) {
+	for (size_t i = track_slot(ptr);; i = (i + 1) % TRACK_OBJECTS) {
+		if (track_objects[i].ptr == ptr)
+			return &track_objects[i];
+		if (track_objects[i].ptr == NULL)
+			return NULL;
+	}
+}
+
+static void track_alloc(void *ptr, size_t size, uintptr_t caller) {
+	if (ptr == NULL)
+		return;
+	bool ints = interrupts_save();
+	LOCK(track_lock);
+	size_t site = 0;
+	while (site < track_site_count && track_sites[site].caller != caller)
+		site++;
+	if (site == track_site_count && site < TRACK_SITES)
+		track_sites[track_site_count++].caller = caller;
+	// Kept at most 3/4 full, lookups end at a free slot
+	if (site == TRACK_SITES || track_object_count >= TRACK_OBJECTS / 4 * 3) {
+		track_dropped++;
+	} else {
+		size_t slot = track_slot(ptr);
+		while (track_objects[slot].ptr != NULL)
+			slot = (slot + 1) % TRACK_OBJECTS;
+		track_object_count++;
+		track_objects[slot] = (struct track_object){
+			.ptr = ptr,
+			.site = site,
+			.generation = track_generation,
+			.size = size};
+		track_sites[site].allocs++;
+		track_sites[site].live++;
+		track_sites[site].live_bytes += size;
+	}
+	UNLOCK(track_lock);
+	interrupts_restore(ints);
+}
+
+static void track_free(void *ptr) {
+	if (ptr == NULL)
+		return;
+	bool ints = interrupts_save();
+	LOCK(track_lock);
+	struct track_object *object = track_find(ptr);
+	if (object != NULL) {
+		track_object_count--;
+		track_sites[object->site].live--;
+		track_sites[object->site].live_bytes -= object->size;
+		// Move back the objects after it that belong in its slot or before,
+		// lookups stop at the first free slot
+		size_t hole = object - track_objects;
+		for (size_t i = (hole + 1) % TRACK_OBJECTS;
+			 track_objects[i].ptr != NULL; i = (i + 1) % TRACK_OBJECTS) {
+			size_t home = track_slot(track_objects[i].ptr);
+			if ((i - home) % TRACK_OBJECTS >= (i - hole) % TRACK_OBJECTS) {
+				track_objects[hole] = track_objects[i];
+				hole = i;
+			}
+		}
+		track_objects[hole].ptr = NULL;
+	}
+	UNLOCK(track_lock);
+	interrupts_restore(ints);
+}
+
+// Objects allocated from here on are reported as new by alloc_track_dump()
+void alloc_track_mark(void) {
+	bool ints = interrupts_save();
+	LOCK(track_lock);
+	track_generation++;
+	UNLOCK(track_lock);
+	interrupts_restore(ints);
+}
+
+// Writes the call sites with objects still allocated to the serial port,
+// most bytes first. "New" objects are the ones allocated since the last
+// alloc_track_mark(), sites whose count of them keeps growing leak
+void alloc_track_dump(void) {
+	static size_t order[TRACK_SITES];
+	static size_t fresh[TRACK_SITES];
+	char line[160];
+	bool ints = interrupts_save();
+	LOCK(track_lock);
+	size_t count = 0;
+	for (size_t site = 0; site < track_site_count; site++) {
+		fresh[site] = 0;
+		if (track_sites[site].live)
+			order[count++] = site;
+	}
+	for (size_t i = 0; i < TRACK_OBJECTS; i++)
+		if (track_objects[i].ptr != NULL &&
+			track_objects[i].generation == track_generation)
+			fresh[track_objects[i].site]++;
+	for (size_t i = 1; i < count; i++) {
+		size_t site = order[i], j = i;
+		for (; j > 0 && track_sites[order[j - 1]].live_bytes <
+							track_sites[site].live_bytes;
+			 j--)
+			order[j] = order[j - 1];
+		order[j] = site;
+	}
+
+	write_serial("Heap: live bytes, live objects (new since the mark), "
+				 "allocations, call site\n");
+	for (size_t i = 0; i < count; i++) {
+		struct track_site *site = &track_sites[order[i]];
+		snprintf(line, sizeof(line), "%10zu %8zu (%zu) %10zu 0x%llX %s\n",
+				 site->live_bytes, site->live, fresh[order[i]], site->allocs,
+				 (uint64_t)site->caller,
+				 symbols_return_function_name(site->caller));
+		write_serial(line);
+	}
+	snprintf(line, sizeof(line),
+			 "Heap: %zu call sites, %zu objects not tracked\n",
+			 track_site_count, track_dropped);
+	write_serial(line);
+	UNLOCK(track_lock);
+	interrupts_restore(ints);
+}
+
+#define TRACK_ALLOC(ptr, size) \
+	track_alloc(ptr, size, (uintptr_t)__builtin_return_address(0))
+#define TRACK_FREE(ptr) track_free(ptr)
+#else
+#define TRACK_ALLOC(ptr, size)
+#define TRACK_FREE(ptr)
+#endif
+
+void *kmalloc(size_t size) {
+	void *ptr = heap_alloc(size);
+	TRACK_ALLOC(ptr, size);
+	return ptr;
+}
+
+void kfree(void *ptr) {
+	if (ptr == NULL)
+		return;
+	TRACK_FREE(ptr);
+	heap_free(ptr);
+}
+
+void *kcalloc(size_t count, size_t size) {
+	if (size && count > (size_t)-1 / size)
+		return NULL;
+	void *ptr = heap_alloc(count * size);
+	if (ptr != NULL)
+		memset(ptr, 0, count * size);
+	TRACK_ALLOC(ptr, count * size);
+	return ptr;
+}
+
+void *krealloc(void *ptr, size_t size) {
+	if (ptr == NULL) {
+		ptr = heap_alloc(size);
+		TRACK_ALLOC(ptr, size);
+		return ptr;
+	}
+	if (size == 0) {
+		TRACK_FREE(ptr);
+		heap_free(ptr);
+		return NULL;
+	}
+	size_t usable = kmalloc_usable_size(ptr);
+	if (size <= usable)
+		return ptr;
+	void *new = heap_alloc(size);
+	if (new == NULL)
+		return NULL;
+	memcpy(new, ptr, usable);
+	TRACK_FREE(ptr);
+	heap_free(ptr);
+	TRACK_ALLOC(new, size);
+	return new;
 }
 
-int liballoc_unlock() {
-	UNLOCK(alloc_lock);
-	asm volatile("sti");
-	return 0;
+void alloc_get_stats(struct alloc_stats *stats) {
+	memset(stats, 0, sizeof(struct alloc_stats));
+	for (size_t class = 0; class < ALLOC_CLASSES; class++) {
+		struct kmem_cache_stats cache_stats;
+		kmem_cache_get_stats(class_caches[class], &cache_stats);
+		size_t cached = 0;
+		if (class < ALLOC_MAGAZINE_CLASSES) {
+			// Read without the locks, it's only a report
+			struct alloc_depot *depot = &depots[class];
+			cached = depot->full_count * ALLOC_MAGAZINE_SIZE;
+			for (size_t cpu = 0; cpu < return_installed_cpus(); cpu++) {
+				struct alloc_cache *cache = &cpu_locals[cpu].alloc_cache;
+				if (cache->loaded[class] != NULL)
+					cached += cache->loaded[class]->count;
+				if (cache->previous[class] != NULL)
+					cached += cache->previous[class]->count;
+			}
+		}
+		if (cached > cache_stats.objects)
+			cached = cache_stats.objects;
+		stats->objects += cache_stats.objects - cached;
+		stats->object_bytes +=
+			(cache_stats.objects - cached) * class_size(class);
+		stats->cached_bytes += cached * class_size(class);
+		stats->slab_bytes += cache_stats.pages * PAGE_SIZE;
+	}
+	stats->large_bytes = large_pages * PAGE_SIZE;
 }
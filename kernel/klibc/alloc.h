@@ -19,7 +19,50 @@
 
 #include <stddef.h>
 
-void *alloc(size_t size);
-void free(void *ptr);
+// kmalloc() rounds sizes up to ALLOC_CLASS_MAX to a power of 2 size class,
+// each with its own slab cache, and gives bigger ones whole pages. What an
+// object is is read from the struct page of its page, it has no header
+#define ALLOC_CLASS_MIN 8
+#define ALLOC_CLASS_MAX 2048
+#define ALLOC_CLASSES 9
+// Classes up to 512 bytes are also cached per CPU: each CPU keeps freed
+// objects of each of them in two magazines, and full magazines are shared by
+// every CPU through the depot of the class
+#define ALLOC_MAGAZINE_CLASSES 7
+#define ALLOC_MAGAZINE_SIZE 16
+// Full and empty magazines the depot of a class keeps at most, objects past
+// that go back to the slab cache
+#define ALLOC_DEPOT_MAX 8
+
+struct alloc_magazine {
+	struct alloc_magazine *next;
+	size_t count;
+	void *objects[ALLOC_MAGAZINE_SIZE];
+};
+
+struct alloc_cache {
+	struct alloc_magazine *loaded[ALLOC_MAGAZINE_CLASSES];
+	struct alloc_magazine *previous[ALLOC_MAGAZINE_CLASSES];
+};
+
+struct alloc_stats {
+	// Objects of the size classes in use, and their size rounded up to it
+	size_t objects;
+	size_t object_bytes;
+	// Freed objects kept in magazines
+	size_t cached_bytes;
+	// Slabs of the size classes, the rest of them is overhead
+	size_t slab_bytes;
+	// Pages of allocations above ALLOC_CLASS_MAX
+	size_t large_bytes;
+};
+
+void alloc_init(void);
+void alloc_enable_cpu_caches(void);
+void alloc_get_stats(struct alloc_stats *stats);
+#ifdef HEAP_TRACKING
+void alloc_track_mark(void);
+void alloc_track_dump(void);
+#endif
 
 #endif
@@ -21,6 +21,7 @@
 #include "asm.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 static inline bool bitmap_test(void *bitmap, size_t bit) {
 	bool ret;
@@ -49,4 +50,45 @@ static inline bool bitmap_unset(void *bitmap, size_t bit) {
 	return ret;
 }
 
+// Index of the lowest set bit, "value" must not be 0 (on CPUs without BMI1
+// tzcnt runs as bsf, whose result is undefined then)
+static inline size_t bit_scan_forward(uint64_t value) {
+	uint64_t ret;
+	asm("tzcnt %0, %1" : "=r"(ret) : "rm"(value) : "cc");
+	return ret;
+}
+
+// Number of bits of a range starting at "bit" that fall in the same word
+static inline size_t bitmap_word_bits(size_t bit, size_t count) {
+	size_t left = 64 - bit % 64;
+	return count < left ? count : left;
+}
+
+static inline uint64_t bitmap_word_mask(size_t bit, size_t bits) {
+	if (bits == 64)
+		return ~(uint64_t)0;
+	return (((uint64_t)1 << bits) - 1) << (bit % 64);
+}
+
+// The range operations work a 64-bit word at a time
+static inline void bitmap_set_range(void *bitmap, size_t bit, size_t count) {
+	uint64_t *words = bitmap;
+	while (count) {
+		size_t bits = bitmap_word_bits(bit, count);
+		words[bit / 64] |= bitmap_word_mask(bit, bits);
+		bit += bits;
+		count -= bits;
+	}
+}
+
+static inline void bitmap_unset_range(void *bitmap, size_t bit, size_t count) {
+	uint64_t *words = bitmap;
+	while (count) {
+		size_t bits = bitmap_word_bits(bit, count);
+		words[bit / 64] &= ~bitmap_word_mask(bit, bits);
+		bit += bits;
+		count -= bits;
+	}
+}
+
 #endif
@@ -39,4 +39,18 @@
 		(_a_ / _b_) * _b_; \
 	})
 
+#define MIN(A, B)              \
+	({                         \
+		typeof(A) _a_ = A;     \
+		typeof(B) _b_ = B;     \
+		_a_ < _b_ ? _a_ : _b_; \
+	})
+
+#define MAX(A, B)              \
+	({                         \
+		typeof(A) _a_ = A;     \
+		typeof(B) _b_ = B;     \
+		_a_ > _b_ ? _a_ : _b_; \
+	})
+
 #endif
@@ -16,8 +16,8 @@
  */
 
 #include "rand.h"
+#include "../cpu/cpu.h"
 #include "../sys/clock.h"
-#include <cpuid.h>
 
 // Mersenne Twister
 // Based on mt19937ar.c found here:
@@ -59,16 +59,13 @@ static void twist(void) {
 // Generate number that can be used as seed
 uint64_t get_rdseed(void) {
 	uint64_t rdseed = 0;
-	uint32_t a = 0, b = 0, c = 0, d = 0;
 
 	// Use rdseed when possible
-	__get_cpuid(7, &a, &b, &c, &d);
-	if (b & bit_RDSEED) {
+	if (cpu_has(CPU_FEATURE_RDSEED)) {
 		asm("rdseed %0" : "=r"(rdseed));
 	} else {
-		__get_cpuid(1, &a, &b, &c, &d);
 		// Use rdrand otherwise
-		if (c & bit_RDRND) {
+		if (cpu_has(CPU_FEATURE_RDRAND)) {
 			asm("rdrand %0" : "=r"(rdseed));
 		} else {
 			// Use UNIX time as last resort
@@ -1,4 +1,5 @@
 #include "resource.h"
+#include "mem.h"
 #include "types.h"
 #include <liballoc.h>
 #include <stddef.h>
@@ -32,15 +33,25 @@ static int stub_ioctl(struct resource *this, int request, ...) {
 	return -1;
 }
 
+// Sets up a resource allocated by the caller, "actual_size" bytes big, with
+// the stub operations
+void resource_init(struct resource *res, size_t actual_size) {
+	memset(res, 0, actual_size);
+	res->actual_size = actual_size;
+
+	res->close = stub_close;
+	res->read = stub_read;
+	res->write = stub_write;
+	res->ioctl = stub_ioctl;
+	res->mmap = NULL;
+}
+
 void *resource_create(size_t actual_size) {
 	struct resource *new = kmalloc(actual_size);
+	if (new == NULL)
+		return NULL;
 
-	new->actual_size = actual_size;
-
-	new->close = stub_close;
-	new->read = stub_read;
-	new->write = stub_write;
-	new->ioctl = stub_ioctl;
+	resource_init(new, actual_size);
 
 	return new;
 }
@@ -19,8 +19,12 @@ struct resource {
 	ssize_t (*write)(struct resource *this, const void *buf, off_t loc,
 					 size_t count);
 	int (*ioctl)(struct resource *this, int request, ...);
+	// Physical page holding "offset", a page aligned offset, with a reference
+	// taken for the mapping. NULL if it can't be mapped
+	void *(*mmap)(struct resource *this, off_t offset);
 };
 
+void resource_init(struct resource *res, size_t actual_size);
 void *resource_create(size_t actual_size);
 
 #endif
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kstack.h"
+#include "../cpu/cpu.h"
+#include "../kernel/panic.h"
+#include "../klibc/lock.h"
+#include "pmm.h"
+#include "vmm.h"
+
+#define KSTACK_PAGES (KSTACK_SIZE / PAGE_SIZE)
+// A slot is the guard page followed by the stack
+#define KSTACK_SLOT (PAGE_SIZE + KSTACK_SIZE)
+
+// What the stack in each slot is used for, NULL while it's free. Read without
+// the lock to report an overflow
+static struct {
+	const char *owner;
+	uint64_t id;
+} slots[KSTACK_MAX];
+// Guards the slots and their mappings. Taken with interrupts off, the
+// scheduler frees the stacks of exited threads with them off, and held
+// across the shootdowns of unmapping stacks
+static lock_t kstack_lock;
+// Slots from this one on were never mapped
+static size_t slots_used = 0;
+// Slots whose stack was unmapped, reused before new ones
+static uint16_t unmapped[KSTACK_MAX];
+static size_t unmapped_count = 0;
+// Free stacks still mapped, for any CPU
+static uint64_t pool[KSTACK_POOL_MAX];
+static size_t pool_count = 0;
+static bool cpu_caches_enabled = false;
+
+static inline uint64_t slot_stack(size_t slot) {
+	return KSTACK_BASE + slot * KSTACK_SLOT + PAGE_SIZE;
+}
+
+// Maps a stack in a free slot, 0 if memory or slots ran out
+static uint64_t map_stack(void) {
+	uint64_t pages[KSTACK_PAGES];
+	for (size_t i = 0; i < KSTACK_PAGES; i++) {
+		pages[i] = (uint64_t)pmm_alloc(1);
+		if (pages[i] == 0) {
+			while (i--)
+				pmm_free((void *)pages[i], 1);
+			return 0;
+		}
+	}
+
+	bool ints = vmm_lock_irqsave(&kstack_lock);
+	size_t slot = KSTACK_MAX;
+	if (unmapped_count)
+		slot = unmapped[--unmapped_count];
+	else if (slots_used < KSTACK_MAX)
+		slot = slots_used++;
+	if (slot < KSTACK_MAX &&
+		vmm_map_pages(kernel_pagemap, slot_stack(slot), pages, KSTACK_PAGES,
+					  PTE_PRESENT | PTE_WRITABLE | PTE_NX)) {
+		vmm_unmap_range(kernel_pagemap, slot_stack(slot), KSTACK_SIZE);
+		unmapped[unmapped_count++] = slot;
+		slot = KSTACK_MAX;
+	}
+	unlock_irqrestore(&kstack_lock, ints);
+
+	if (slot == KSTACK_MAX) {
+		for (size_t i = 0; i < KSTACK_PAGES; i++)
+			pmm_free((void *)pages[i], 1);
+		return 0;
+	}
+	return slot_stack(slot);
+}
+
+// Called once every CPU has its CPU local data loaded in gsbase
+void kstack_enable_cpu_caches(void) {
+	cpu_caches_enabled = true;
+}
+
+// Allocates a KSTACK_SIZE stack with a guard page below it, "owner" and "id"
+// name it if it overflows. Returns the lowest address of the stack, or NULL
+void *kstack_alloc(const char *owner, uint64_t id) {
+	uint64_t stack = 0;
+	if (cpu_caches_enabled) {
+		bool ints = interrupts_save();
+		struct kstack_cache *cache = &this_cpu->kstack_cache;
+		if (cache->count)
+			stack = cache->stacks[--cache->count];
+		interrupts_restore(ints);
+	}
+	if (stack == 0) {
+		bool ints = vmm_lock_irqsave(&kstack_lock);
+		if (pool_count)
+			stack = pool[--pool_count];
+		unlock_irqrestore(&kstack_lock, ints);
+	}
+	if (stack == 0)
+		stack = map_stack();
+	if (stack == 0)
+		return NULL;
+	size_t slot = (stack - KSTACK_BASE) / KSTACK_SLOT;
+	slots[slot].id = id;
+	slots[slot].owner = owner;
+	return (void *)stack;
+}
+
+// Frees a stack from kstack_alloc(), which nothing may run on anymore. It
+// stays mapped in a cache unless they're all full
+void kstack_free(void *ptr) {
+	uint64_t stack = (uint64_t)ptr;
+	if (stack == 0)
+		return;
+	size_t slot = (stack - KSTACK_BASE) / KSTACK_SLOT;
+	if (stack < KSTACK_BASE || slot >= KSTACK_MAX ||
+		stack != slot_stack(slot) || slots[slot].owner == NULL)
+		PANIC("kstack_free() of memory kstack_alloc() didn't return");
+	slots[slot].owner = NULL;
+
+	if (cpu_caches_enabled) {
+		bool ints = interrupts_save();
+		struct kstack_cache *cache = &this_cpu->kstack_cache;
+		bool cached = cache->count < KSTACK_CACHE_SIZE;
+		if (cached)
+			cache->stacks[cache->count++] = stack;
+		interrupts_restore(ints);
+		if (cached)
+			return;
+	}
+
+	bool ints = vmm_lock_irqsave(&kstack_lock);
+	if (pool_count < KSTACK_POOL_MAX) {
+		pool[pool_count++] = stack;
+	} else {
+		vmm_free_range(kernel_pagemap, stack, KSTACK_SIZE);
+		unmapped[unmapped_count++] = slot;
+	}
+	unlock_irqrestore(&kstack_lock, ints);
+}
+
+// Returns what the stack whose guard page "addr" is in is used for, and its
+// "id", or NULL if "addr" isn't in the guard page of a stack in use. Safe to
+// call from fault handlers, it takes no lock
+const char *kstack_guard_owner(uint64_t addr, uint64_t *id) {
+	if (addr < KSTACK_BASE)
+		return NULL;
+	size_t slot = (addr - KSTACK_BASE) / KSTACK_SLOT;
+	if (slot >= KSTACK_MAX || addr >= slot_stack(slot))
+		return NULL;
+	*id = slots[slot].id;
+	return slots[slot].owner;
+}
@@ -0,0 +1,45 @@
+#ifndef KSTACK_H
+#define KSTACK_H
+
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "vmalloc.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define KSTACK_SIZE 32768
+// Kernel stacks live in slots right above the vmalloc() range, each one has
+// an unmapped guard page below the stack so an overflow faults instead of
+// writing over whatever is mapped there
+#define KSTACK_BASE VMALLOC_TOP
+#define KSTACK_MAX 4096
+// Free stacks kept mapped on each CPU, and shared by every CPU, before they
+// are unmapped and their memory freed
+#define KSTACK_CACHE_SIZE 4
+#define KSTACK_POOL_MAX 64
+
+struct kstack_cache {
+	size_t count;
+	uint64_t stacks[KSTACK_CACHE_SIZE];
+};
+
+void kstack_enable_cpu_caches(void);
+void *kstack_alloc(const char *owner, uint64_t id);
+void kstack_free(void *stack);
+const char *kstack_guard_owner(uint64_t addr, uint64_t *id);
+
+#endif
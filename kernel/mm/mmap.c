@@ -0,0 +1,99 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mmap.h"
+#include "../klibc/math.h"
+#include "vma.h"
+#include "vmm.h"
+
+// Processes run in ring 0 for now, so pages aren't mapped with PTE_USER
+static uint64_t prot_flags(int prot) {
+	uint64_t flags = 0;
+	if (prot & (PROT_READ | PROT_WRITE | PROT_EXEC))
+		flags |= PTE_PRESENT;
+	if (prot & PROT_WRITE)
+		flags |= PTE_WRITABLE;
+	if (!(prot & PROT_EXEC))
+		flags |= PTE_NX;
+	return flags;
+}
+
+// Maps "length" bytes of "res" from "offset", or zeroed memory with
+// MAP_ANONYMOUS. Pages are only mapped when they're first touched. The area
+// goes at "addr" with MAP_FIXED, replacing what was there, otherwise "addr" is
+// only a hint. Fixed mappings have to be between VMA_MMAP_BASE and
+// VMA_MMAP_TOP. Returns the address of the mapping or MAP_FAILED
+void *mmap(struct pagemap *pagemap, void *addr, size_t length, int prot,
+		   int flags, struct resource *res, off_t offset) {
+	if (length == 0 || length > VMA_MMAP_TOP ||
+		!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+		return MAP_FAILED;
+	length = ALIGN_UP(length, PAGE_SIZE);
+
+	struct vma area = {
+		.base = ALIGN_DOWN((uint64_t)addr, PAGE_SIZE),
+		.length = length,
+		.flags = prot_flags(prot),
+		.type = VMA_ANONYMOUS,
+		.shared = flags & MAP_SHARED,
+	};
+	if (!(flags & MAP_ANONYMOUS)) {
+		if (res == NULL || res->mmap == NULL || offset < 0 ||
+			offset % PAGE_SIZE)
+			return MAP_FAILED;
+		area.type = VMA_FILE;
+		area.res = res;
+		area.offset = offset;
+	}
+
+	if (flags & MAP_FIXED) {
+		// Thread stacks are above the range, and nothing goes at 0
+		if ((uint64_t)addr % PAGE_SIZE || (uint64_t)addr < VMA_MMAP_BASE ||
+			(uint64_t)addr + length > VMA_MMAP_TOP ||
+			vma_replace(pagemap, &area))
+			return MAP_FAILED;
+	} else if (vma_add_area(pagemap, &area, false))
+		return MAP_FAILED;
+	return (void *)area.base;
+}
+
+// Whether the range is in the lower half, rounding it up to whole pages. False
+// if it wraps around
+static bool user_range(void *addr, size_t *length) {
+	if (*length > VMM_KERNEL_HALF)
+		return false;
+	*length = ALIGN_UP(*length, PAGE_SIZE);
+	uint64_t end = (uint64_t)addr + *length;
+	return end >= (uint64_t)addr && end <= VMM_KERNEL_HALF;
+}
+
+// Unmaps every page of the range, which may span several mappings or parts of
+// them. Returns 0 or -1 if the range is empty or isn't page aligned
+int munmap(struct pagemap *pagemap, void *addr, size_t length) {
+	if (length == 0 || !user_range(addr, &length) ||
+		vma_remove(pagemap, (uint64_t)addr, length))
+		return -1;
+	return 0;
+}
+
+// Changes the access allowed to the range, which has to be mapped. Returns 0
+// or -1
+int mprotect(struct pagemap *pagemap, void *addr, size_t length, int prot) {
+	if (!user_range(addr, &length) ||
+		vma_protect(pagemap, (uint64_t)addr, length, prot_flags(prot)))
+		return -1;
+	return 0;
+}
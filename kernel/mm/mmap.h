@@ -0,0 +1,44 @@
+#ifndef MMAP_H
+#define MMAP_H
+
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../klibc/resource.h"
+#include "../klibc/types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#define MAP_SHARED 0x1
+#define MAP_PRIVATE 0x2
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+
+#define MAP_FAILED ((void *)-1)
+
+struct pagemap;
+
+void *mmap(struct pagemap *pagemap, void *addr, size_t length, int prot,
+		   int flags, struct resource *res, off_t offset);
+int munmap(struct pagemap *pagemap, void *addr, size_t length);
+int mprotect(struct pagemap *pagemap, void *addr, size_t length, int prot);
+
+#endif
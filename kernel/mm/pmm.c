@@ -16,17 +16,338 @@
  */
 
 #include "pmm.h"
+#include "../cpu/cpu.h"
+#include "../kernel/panic.h"
 #include "../klibc/bitman.h"
+#include "../klibc/lock.h"
 #include "../klibc/math.h"
 #include "../klibc/mem.h"
+#include "../klibc/printf.h"
 #include "vmm.h"
 #include <stivale2.h>
 
+// Free blocks are linked through their first page, using the higher half
+// direct map. A block is only ever read through this header when its first
+// page is clear in the bitmap, which is guaranteed to mean it is the head of
+// a free block.
+struct free_block {
+	struct free_block *next;
+	struct free_block *prev;
+	size_t order;
+};
+
 static void *bitmap;
-static size_t last_used_index = 0;
 static uintptr_t highest_page = 0;
+static size_t total_pages = 0;
+
+// One buddy allocator per NUMA node. They all share pmm_lock, as blocks of
+// different nodes can share a word of the bitmap.
+struct zone {
+	struct free_block *free_lists[PMM_MAX_ORDER + 1];
+	// Bit "n" is set when free_lists[n] isn't empty
+	uint64_t free_orders;
+	size_t free_pages;
+};
+
+static struct zone zones[PMM_MAX_NODES];
+// Zones to allocate from for each node, nearest first
+static uint8_t node_fallback[PMM_MAX_NODES][PMM_MAX_NODES];
+static struct pmm_numa_range numa_ranges[PMM_MAX_NUMA_RANGES];
+static size_t numa_range_count = 0;
+size_t pmm_node_count = 1;
+static lock_t pmm_lock;
+
+// Pages in the buddy allocators, i.e. free for anyone to take right away
+size_t pmm_free_pages = 0;
+struct pmm_watermarks pmm_watermarks = {0};
+static struct pmm_shrinker *shrinkers = NULL;
+static lock_t shrinker_lock;
+static lock_t shrinking;
+// Set when free memory went below the low watermark, for pmm_idle()
+static bool shrink_pending = false;
+static bool cpu_caches_enabled = false;
+
+// Free 2MB blocks held back for pmm_alloc_aligned(), so huge pages can still
+// be backed once small allocations have fragmented everything else
+#define HUGE_ORDER 9
+static uintptr_t huge_reserve[PMM_HUGE_RESERVE];
+static size_t huge_reserve_count = 0;
+uint64_t pmm_init_cycles = 0;
+
+// Pages zeroed ahead of time by the scheduler when it has nothing to run,
+// one pool per node
+struct zero_pool {
+	uintptr_t pages[PMM_ZERO_POOL_SIZE];
+	size_t count;
+	lock_t lock;
+};
+
+static struct zero_pool zero_pools[PMM_MAX_NODES];
+uint64_t pmm_zero_pool_hits = 0;
+uint64_t pmm_zero_pool_misses = 0;
+
+// Bootloader and ACPI reclaimable entries, handed over by pmm_reclaim() once
+// the kernel is done with the stivale2 struct and the firmware's ACPI tables
+struct reclaimable_range {
+	uintptr_t base;
+	size_t length;
+};
+
+static struct reclaimable_range reclaimable[PMM_MAX_RECLAIMABLE];
+static size_t reclaimable_count = 0;
+
+struct page **pmm_sections = NULL;
+size_t pmm_section_count = 0;
+uint64_t pmm_page_type_counts[PAGE_TYPE_COUNT] = {0};
+
+static inline struct free_block *pfn_to_block(size_t pfn) {
+	return (struct free_block *)(pfn * PAGE_SIZE + MEM_PHYS_OFFSET);
+}
+
+static inline size_t block_to_pfn(struct free_block *block) {
+	return ((uintptr_t)block - MEM_PHYS_OFFSET) / PAGE_SIZE;
+}
+
+// Smallest order whose block can hold "count" pages
+static inline size_t order_for(size_t count) {
+	if (count <= 1)
+		return 0;
+	return 64 - __builtin_clzll(count - 1);
+}
+
+// Biggest order of a naturally aligned block starting at "pfn" that fits
+// inside "count" pages
+static inline size_t max_order_at(size_t pfn, size_t count) {
+	size_t order = 63 - __builtin_clzll(count);
+	if (pfn && (size_t)__builtin_ctzll(pfn) < order)
+		order = __builtin_ctzll(pfn);
+	if (order > PMM_MAX_ORDER)
+		order = PMM_MAX_ORDER;
+	return order;
+}
+
+// Pages the page frame database doesn't cover yet all belong to node 0
+static inline size_t pfn_node(size_t pfn) {
+	struct page *page = pfn_to_page(pfn);
+	return page ? page->node : 0;
+}
+
+static void list_add(struct zone *zone, size_t pfn, size_t order) {
+	struct free_block *block = pfn_to_block(pfn);
+	block->order = order;
+	block->prev = NULL;
+	block->next = zone->free_lists[order];
+	if (block->next)
+		block->next->prev = block;
+	zone->free_lists[order] = block;
+	zone->free_orders |= (uint64_t)1 << order;
+	zone->free_pages += (size_t)1 << order;
+	pmm_free_pages += (size_t)1 << order;
+}
+
+static void list_remove(struct zone *zone, struct free_block *block) {
+	if (block->prev)
+		block->prev->next = block->next;
+	else if ((zone->free_lists[block->order] = block->next) == NULL)
+		zone->free_orders &= ~((uint64_t)1 << block->order);
+	if (block->next)
+		block->next->prev = block->prev;
+	zone->free_pages -= (size_t)1 << block->order;
+	pmm_free_pages -= (size_t)1 << block->order;
+}
+
+// Frees a naturally aligned block, merging it with its buddies for as long
+// as they are free too and on the same node
+static void free_block(size_t pfn, size_t order) {
+	size_t node = pfn_node(pfn);
+	struct zone *zone = &zones[node];
+	bitmap_unset_range(bitmap, pfn, (size_t)1 << order);
+
+	while (order < PMM_MAX_ORDER) {
+		size_t buddy = pfn ^ ((size_t)1 << order);
+		if (buddy + ((size_t)1 << order) > total_pages)
+			break;
+		if (bitmap_test(bitmap, buddy))
+			break;
+		if (pfn_node(buddy) != node)
+			break;
+		struct free_block *block = pfn_to_block(buddy);
+		if (block->order != order)
+			break;
+		list_remove(zone, block);
+		pfn &= ~((size_t)1 << order);
+		order++;
+	}
+
+	list_add(zone, pfn, order);
+}
+
+// End of the run of pages starting at "pfn" that are all on the same node
+static size_t node_run_end(size_t pfn, size_t end) {
+	for (size_t i = 0; i < numa_range_count; i++) {
+		size_t base = numa_ranges[i].base / PAGE_SIZE;
+		size_t top = (numa_ranges[i].base + numa_ranges[i].length) / PAGE_SIZE;
+		if (base > pfn && base < end)
+			end = base;
+		if (top > pfn && top < end)
+			end = top;
+	}
+	return end;
+}
+
+// Frees an arbitrary run of pages by splitting it in naturally aligned blocks
+static void free_range(size_t pfn, size_t count) {
+	size_t end = pfn + count;
+	while (pfn < end) {
+		size_t run_end = node_run_end(pfn, end);
+		while (pfn < run_end) {
+			size_t order = max_order_at(pfn, run_end - pfn);
+			free_block(pfn, order);
+			pfn += (size_t)1 << order;
+		}
+	}
+}
+
+static void *buddy_alloc(struct zone *zone, size_t count, size_t order) {
+	if (order > PMM_MAX_ORDER)
+		return NULL;
+
+	// Find the smallest order with a free block that's big enough
+	uint64_t candidates = zone->free_orders >> order;
+	if (candidates == 0)
+		return NULL;
+	size_t current = order + bit_scan_forward(candidates);
+
+	struct free_block *block = zone->free_lists[current];
+	list_remove(zone, block);
+	size_t pfn = block_to_pfn(block);
+
+	// Split the block down to the requested order, putting the upper halves
+	// back in their free lists
+	while (current > order) {
+		current--;
+		list_add(zone, pfn + ((size_t)1 << current), current);
+	}
+
+	bitmap_set_range(bitmap, pfn, count);
+
+	// Give back the pages rounding the request up to a power of 2 wasted
+	size_t block_pages = (size_t)1 << order;
+	if (count < block_pages)
+		free_range(pfn + count, block_pages - count);
+
+	return (void *)(pfn * PAGE_SIZE);
+}
+
+// Keeps up to PMM_HUGE_RESERVE free 2MB blocks aside, from any node, as
+// long as memory isn't getting tight
+static void reserve_refill(void) {
+	for (size_t i = 0; i < pmm_node_count; i++) {
+		struct zone *zone = &zones[i];
+		while (huge_reserve_count < PMM_HUGE_RESERVE &&
+			   (zone->free_orders >> HUGE_ORDER) &&
+			   pmm_free_pages > pmm_watermarks.high) {
+			void *block =
+				buddy_alloc(zone, (size_t)1 << HUGE_ORDER, HUGE_ORDER);
+			huge_reserve[huge_reserve_count++] = (uintptr_t)block;
+		}
+	}
+}
+
+static bool reserve_release(void) {
+	if (huge_reserve_count == 0)
+		return false;
+	uintptr_t block = huge_reserve[--huge_reserve_count];
+	free_range(block / PAGE_SIZE, (size_t)1 << HUGE_ORDER);
+	return true;
+}
+
+static void *node_alloc(size_t count, size_t order, size_t node) {
+	for (size_t i = 0; i < pmm_node_count; i++) {
+		void *ret = buddy_alloc(&zones[node_fallback[node][i]], count, order);
+		if (ret != NULL)
+			return ret;
+	}
+	return NULL;
+}
+
+// Tries "node" then the others, nearest first. Only breaks into the huge page
+// reserve when memory is otherwise exhausted.
+static void *inner_alloc(size_t count, size_t order, size_t node) {
+	void *ret = node_alloc(count, order, node);
+	while (ret == NULL && reserve_release())
+		ret = node_alloc(count, order, node);
+	return ret;
+}
+
+static void pages_account(uint8_t type, size_t count, bool add) {
+	if (type == PAGE_TYPE_FREE || count == 0)
+		return;
+	if (add)
+		__sync_fetch_and_add(&pmm_page_type_counts[type], count);
+	else
+		__sync_fetch_and_sub(&pmm_page_type_counts[type], count);
+}
+
+// Moves "count" pages to "type" in the page frame database, "reset" also
+// gives them the state of a freshly allocated (or freed) page
+static void pages_set_type(size_t pfn, size_t count, enum page_type type,
+						   bool reset) {
+	uint8_t run_type = PAGE_TYPE_FREE;
+	size_t run = 0, done = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		struct page *page = pfn_to_page(pfn + i);
+		if (page == NULL)
+			continue;
+		done++;
+
+		// Runs of pages of the same type are accounted for at once
+		if (page->type != run_type) {
+			pages_account(run_type, run, false);
+			run_type = page->type;
+			run = 0;
+		}
+		run++;
+
+		page->type = type;
+		if (reset) {
+			page->refcount = type != PAGE_TYPE_FREE;
+			page->mapcount = 0;
+			page->flags = 0;
+			page->owner = NULL;
+			page->private = 0;
+		}
+	}
+
+	pages_account(run_type, run, false);
+	pages_account(type, done, true);
+}
+
+#define SECTION_ARRAY_PAGES \
+	DIV_ROUNDUP(PMM_SECTION_PAGES * sizeof(struct page), PAGE_SIZE)
+
+static void section_alloc(size_t section) {
+	size_t pages = SECTION_ARRAY_PAGES;
+	void *phys = buddy_alloc(&zones[0], pages, order_for(pages));
+	if (phys == NULL)
+		PANIC("PMM: Out of memory for the page frame database");
+
+	struct page *array = phys + MEM_PHYS_OFFSET;
+	memset(array, 0, pages * PAGE_SIZE);
+	for (size_t i = 0; i < PMM_SECTION_PAGES; i++)
+		array[i].section = section;
+
+	pmm_sections[section] = array;
+}
+
+static struct pmm_shrinker zero_pool_shrinker;
+static struct pmm_shrinker cache_shrinker;
+static struct pmm_shrinker reserve_shrinker;
 
 void pmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries) {
+	uint64_t start = rdtsc();
+
 	// First, calculate how big the bitmap needs to be
 	for (size_t i = 0; i < memmap_entries; i++) {
 		if (memmap[i].type != STIVALE2_MMAP_USABLE &&
@@ -40,7 +361,9 @@ void pmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries) {
 			highest_page = top;
 	}
 
+	total_pages = highest_page / PAGE_SIZE;
 	size_t bitmap_size = ALIGN_UP((highest_page / PAGE_SIZE) / 8, PAGE_SIZE);
+	uintptr_t bitmap_phys = 0;
 
 	// Second, find a location with enough free pages to host the bitmap
 	for (size_t i = 0; i < memmap_entries; i++) {
@@ -48,6 +371,7 @@ void pmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries) {
 			continue;
 
 		if (memmap[i].length >= bitmap_size) {
+			bitmap_phys = memmap[i].base;
 			bitmap = (void *)memmap[i].base + MEM_PHYS_OFFSET;
 
 			// Initialise entire bitmap to 1 (non-free)
@@ -60,47 +384,447 @@ void pmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries) {
 		}
 	}
 
-	// Third, populate free bitmap entries according to memory map
+	// Third, hand the usable entries of the memory map to the buddy allocator
 	for (size_t i = 0; i < memmap_entries; i++) {
 		if (memmap[i].type != STIVALE2_MMAP_USABLE)
 			continue;
 
-		for (uintptr_t j = 0; j < memmap[i].length; j += PAGE_SIZE)
-			bitmap_unset(bitmap, (memmap[i].base + j) / PAGE_SIZE);
+		size_t pfn = memmap[i].base / PAGE_SIZE;
+		size_t count = memmap[i].length / PAGE_SIZE;
+
+		// Never hand out the page at physical address 0, it can't be told
+		// apart from an allocation failure
+		if (pfn == 0 && count) {
+			pfn++;
+			count--;
+		}
+
+		if (count)
+			free_range(pfn, count);
 	}
+
+	// Fourth, build the page frame database. Sections holding any memory the
+	// PMM manages get their struct page array, everything else stays a hole.
+	pmm_section_count = DIV_ROUNDUP(total_pages, PMM_SECTION_PAGES);
+	ASSERT(pmm_section_count <= PMM_MAX_SECTIONS);
+	size_t table_pages =
+		DIV_ROUNDUP(pmm_section_count * sizeof(struct page *), PAGE_SIZE);
+	void *table = buddy_alloc(&zones[0], table_pages, order_for(table_pages));
+	if (table == NULL)
+		PANIC("PMM: Out of memory for the page frame database");
+	pmm_sections = table + MEM_PHYS_OFFSET;
+	memset(pmm_sections, 0, table_pages * PAGE_SIZE);
+
+	for (size_t i = 0; i < memmap_entries; i++) {
+		if (memmap[i].type != STIVALE2_MMAP_USABLE &&
+			memmap[i].type != STIVALE2_MMAP_ACPI_RECLAIMABLE &&
+			memmap[i].type != STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE)
+			continue;
+		if (memmap[i].length == 0)
+			continue;
+
+		size_t first = (memmap[i].base / PAGE_SIZE) >> PMM_SECTION_SHIFT;
+		size_t last = ((memmap[i].base + memmap[i].length - 1) / PAGE_SIZE) >>
+					  PMM_SECTION_SHIFT;
+		for (size_t section = first; section <= last; section++)
+			if (pmm_sections[section] == NULL)
+				section_alloc(section);
+	}
+
+	// Whatever the PMM won't hand out is reserved, its own metadata included.
+	// Reclaimable memory stays reserved until pmm_reclaim().
+	pages_set_type((uintptr_t)table / PAGE_SIZE, table_pages,
+				   PAGE_TYPE_RESERVED, true);
+	for (size_t section = 0; section < pmm_section_count; section++) {
+		if (pmm_sections[section] == NULL)
+			continue;
+		uintptr_t phys = (uintptr_t)pmm_sections[section] - MEM_PHYS_OFFSET;
+		pages_set_type(phys / PAGE_SIZE, SECTION_ARRAY_PAGES,
+					   PAGE_TYPE_RESERVED, true);
+	}
+	pages_set_type(bitmap_phys / PAGE_SIZE, bitmap_size / PAGE_SIZE,
+				   PAGE_TYPE_RESERVED, true);
+	for (size_t i = 0; i < memmap_entries; i++) {
+		if (memmap[i].type == STIVALE2_MMAP_USABLE)
+			continue;
+
+		size_t pfn = memmap[i].base / PAGE_SIZE;
+		size_t end = DIV_ROUNDUP(memmap[i].base + memmap[i].length, PAGE_SIZE);
+		if (end > total_pages)
+			end = total_pages;
+		if (pfn < end)
+			pages_set_type(pfn, end - pfn, PAGE_TYPE_RESERVED, true);
+	}
+
+	// Finally, remember what can be given back later, the memory map itself
+	// lives in bootloader reclaimable memory
+	for (size_t i = 0; i < memmap_entries; i++) {
+		if (memmap[i].type != STIVALE2_MMAP_ACPI_RECLAIMABLE &&
+			memmap[i].type != STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE)
+			continue;
+
+		if (reclaimable_count == PMM_MAX_RECLAIMABLE)
+			break;
+
+		reclaimable[reclaimable_count].base = memmap[i].base;
+		reclaimable[reclaimable_count].length = memmap[i].length;
+		reclaimable_count++;
+	}
+
+	// Scale the watermarks with memory, everything reclaimable included
+	size_t managed = pmm_free_pages;
+	for (size_t i = 0; i < reclaimable_count; i++)
+		managed += reclaimable[i].length / PAGE_SIZE;
+	size_t min = managed / 256;
+	if (min < PMM_WATERMARK_MIN_PAGES)
+		min = PMM_WATERMARK_MIN_PAGES;
+	if (min > PMM_WATERMARK_MAX_PAGES)
+		min = PMM_WATERMARK_MAX_PAGES;
+	pmm_watermarks.min = min;
+	pmm_watermarks.low = min * 2;
+	pmm_watermarks.high = min * 3;
+
+	reserve_refill();
+	pmm_register_shrinker(&zero_pool_shrinker);
+	pmm_register_shrinker(&cache_shrinker);
+	pmm_register_shrinker(&reserve_shrinker);
+
+	pmm_init_cycles = rdtsc() - start;
 }
 
-static void *inner_alloc(size_t count, size_t limit) {
-	size_t p = 0;
+// Called once nothing refers to bootloader or ACPI reclaimable memory anymore,
+// i.e. after the stivale2 struct, the modules and the ACPI tables were used
+void pmm_reclaim(void) {
+	size_t pages = 0;
+
+	bool ints = lock_irqsave(&pmm_lock);
+	for (size_t i = 0; i < reclaimable_count; i++) {
+		// ACPI reclaimable entries don't have to be page aligned
+		size_t pfn = DIV_ROUNDUP(reclaimable[i].base, PAGE_SIZE);
+		size_t end = (reclaimable[i].base + reclaimable[i].length) / PAGE_SIZE;
+
+		if (pfn == 0)
+			pfn++;
 
-	while (last_used_index < limit) {
-		if (!bitmap_test(bitmap, last_used_index++)) {
-			if (++p == count) {
-				size_t page = last_used_index - count;
-				for (size_t i = page; i < last_used_index; i++) {
-					bitmap_set(bitmap, i);
-				}
-				return (void *)(page * PAGE_SIZE);
+		if (end <= pfn)
+			continue;
+
+		pages_set_type(pfn, end - pfn, PAGE_TYPE_FREE, true);
+		free_range(pfn, end - pfn);
+		pages += end - pfn;
+	}
+	reclaimable_count = 0;
+	if (huge_reserve_count < PMM_HUGE_RESERVE)
+		reserve_refill();
+	unlock_irqrestore(&pmm_lock, ints);
+
+	printf("PMM: Reclaimed %zu MiB of bootloader and ACPI memory\n",
+		   (pages * PAGE_SIZE) / 0x100000);
+}
+
+// Splits memory in per-node zones once the SRAT has been parsed. Must run
+// before the per-CPU caches are enabled.
+void pmm_numa_init(struct pmm_numa_range *ranges, size_t range_count,
+				   size_t node_count,
+				   uint8_t distances[PMM_MAX_NODES][PMM_MAX_NODES]) {
+	if (node_count < 2)
+		return;
+	if (node_count > PMM_MAX_NODES)
+		node_count = PMM_MAX_NODES;
+	if (range_count > PMM_MAX_NUMA_RANGES)
+		range_count = PMM_MAX_NUMA_RANGES;
+
+	bool ints = lock_irqsave(&pmm_lock);
+
+	// Tag every page with its node, pages outside of the ranges stay on 0
+	for (size_t i = 0; i < range_count; i++) {
+		numa_ranges[i] = ranges[i];
+		size_t pfn = ranges[i].base / PAGE_SIZE;
+		size_t end = (ranges[i].base + ranges[i].length) / PAGE_SIZE;
+		if (end > total_pages)
+			end = total_pages;
+		for (; pfn < end; pfn++) {
+			struct page *page = pfn_to_page(pfn);
+			if (page != NULL)
+				page->node = ranges[i].node;
+		}
+	}
+	numa_range_count = range_count;
+	pmm_node_count = node_count;
+
+	// Nearest nodes first, ties go to the lowest node number
+	for (size_t node = 0; node < node_count; node++) {
+		for (size_t i = 0; i < node_count; i++) {
+			size_t j = i;
+			while (j > 0 && distances[node][node_fallback[node][j - 1]] >
+								distances[node][i]) {
+				node_fallback[node][j] = node_fallback[node][j - 1];
+				j--;
 			}
-		} else {
-			p = 0;
+			node_fallback[node][j] = i;
 		}
 	}
 
-	return NULL;
+	// Everything is still in the first zone, hand it over to the right ones.
+	// The blocks are marked as used first so they aren't merged with each
+	// other while being moved.
+	struct zone boot_zone = zones[0];
+	memset(&zones[0], 0, sizeof(struct zone));
+	pmm_free_pages -= boot_zone.free_pages;
+	for (size_t order = 0; order <= PMM_MAX_ORDER; order++)
+		for (struct free_block *block = boot_zone.free_lists[order]; block;
+			 block = block->next)
+			bitmap_set_range(bitmap, block_to_pfn(block), (size_t)1 << order);
+	for (size_t order = 0; order <= PMM_MAX_ORDER; order++) {
+		struct free_block *block = boot_zone.free_lists[order];
+		while (block != NULL) {
+			struct free_block *next = block->next;
+			free_range(block_to_pfn(block), (size_t)1 << order);
+			block = next;
+		}
+	}
+
+	unlock_irqrestore(&pmm_lock, ints);
+
+	for (size_t node = 0; node < node_count; node++)
+		printf("PMM: Node %zu: %zu MiB free\n", node,
+			   (zones[node].free_pages * PAGE_SIZE) / 0x100000);
+}
+
+static inline size_t current_node(void) {
+	return cpu_caches_enabled ? this_cpu->numa_node : 0;
+}
+
+// Called once every CPU has its CPU local data loaded in gsbase
+void pmm_enable_cpu_caches(void) {
+	cpu_caches_enabled = true;
+}
+
+static void cache_refill(struct pmm_cache *cache) {
+	LOCK(pmm_lock);
+	while (cache->cold_count < PMM_CACHE_BATCH) {
+		void *page = inner_alloc(1, 0, this_cpu->numa_node);
+		if (page == NULL)
+			break;
+		cache->cold[cache->cold_count++] = (uintptr_t)page;
+	}
+	UNLOCK(pmm_lock);
+}
+
+// Gives the least recently freed (so the coldest) hot pages back
+static void cache_drain(struct pmm_cache *cache, size_t count) {
+	LOCK(pmm_lock);
+	for (size_t i = 0; i < count; i++)
+		free_range(cache->hot[i] / PAGE_SIZE, 1);
+	UNLOCK(pmm_lock);
+	cache->hot_count -= count;
+	memmove(cache->hot, cache->hot + count,
+			cache->hot_count * sizeof(uintptr_t));
+}
+
+// Interrupts are kept off so the thread can't migrate to another CPU while
+// it's touching this CPU's cache, no lock is needed otherwise
+static void *cache_alloc(void) {
+	bool ints = interrupts_save();
+	struct pmm_cache *cache = &this_cpu->pmm_cache;
+	void *ret = NULL;
+
+	if (cache->hot_count == 0 && cache->cold_count == 0)
+		cache_refill(cache);
+
+	if (cache->hot_count)
+		ret = (void *)cache->hot[--cache->hot_count];
+	else if (cache->cold_count)
+		ret = (void *)cache->cold[--cache->cold_count];
+
+	interrupts_restore(ints);
+	return ret;
+}
+
+static void cache_free(void *ptr) {
+	bool ints = interrupts_save();
+	struct pmm_cache *cache = &this_cpu->pmm_cache;
+
+	// Pages of other nodes go straight back to their zone, so the cache only
+	// hands out local ones
+	if (pfn_node((uintptr_t)ptr / PAGE_SIZE) != this_cpu->numa_node) {
+		LOCK(pmm_lock);
+		free_range((uintptr_t)ptr / PAGE_SIZE, 1);
+		UNLOCK(pmm_lock);
+		interrupts_restore(ints);
+		return;
+	}
+
+	if (cache->hot_count == PMM_CACHE_HIGH)
+		cache_drain(cache, PMM_CACHE_BATCH);
+
+	cache->hot[cache->hot_count++] = (uintptr_t)ptr;
+	interrupts_restore(ints);
+}
+
+// Allocation and freeing without touching the page frame database, for pages
+// that stay free as far as the rest of the kernel is concerned
+static void *alloc_pages(size_t count, size_t node) {
+	if (count == 1 && cpu_caches_enabled && node == this_cpu->numa_node)
+		return cache_alloc();
+
+	bool ints = lock_irqsave(&pmm_lock);
+	void *ret = inner_alloc(count, order_for(count), node);
+	unlock_irqrestore(&pmm_lock, ints);
+	return ret;
+}
+
+static void free_pages(void *ptr, size_t count) {
+	if (count == 1 && cpu_caches_enabled) {
+		cache_free(ptr);
+		return;
+	}
+
+	bool ints = lock_irqsave(&pmm_lock);
+	free_range((size_t)ptr / PAGE_SIZE, count);
+	if (huge_reserve_count < PMM_HUGE_RESERVE)
+		reserve_refill();
+	unlock_irqrestore(&pmm_lock, ints);
+}
+
+// Called after every allocation. Below the min watermark the caller frees
+// memory itself, below the low one it's left for when a CPU is idle.
+static inline void check_watermarks(void) {
+	size_t free = pmm_free_pages;
+	if (free >= pmm_watermarks.low)
+		return;
+	if (free < pmm_watermarks.min)
+		pmm_shrink(pmm_watermarks.high - free);
+	else
+		shrink_pending = true;
+}
+
+// Hands freshly allocated pages to the caller
+static void *alloc_done(void *ptr, size_t count) {
+	check_watermarks();
+	if (ptr == NULL)
+		return NULL;
+
+	pages_set_type((uintptr_t)ptr / PAGE_SIZE, count, PAGE_TYPE_KERNEL, true);
+
+	if (cpu_caches_enabled) {
+		bool ints = interrupts_save();
+		struct pmm_cache *cache = &this_cpu->pmm_cache;
+		if (pfn_node((uintptr_t)ptr / PAGE_SIZE) == this_cpu->numa_node)
+			cache->numa_local++;
+		else
+			cache->numa_remote++;
+		interrupts_restore(ints);
+	}
+
+	return ptr;
 }
 
 void *pmm_alloc(size_t count) {
-	size_t l = last_used_index;
-	void *ret = inner_alloc(count, highest_page / PAGE_SIZE);
-	if (ret == NULL) {
-		last_used_index = 0;
-		ret = inner_alloc(count, l);
+	return pmm_alloc_node(count, current_node());
+}
+
+// Allocates from "node" first, falling back to the nearest other nodes
+void *pmm_alloc_node(size_t count, size_t node) {
+	if (node >= pmm_node_count)
+		node = 0;
+	void *ret = alloc_pages(count, node);
+	// Out of memory, see if the caches can give some back before giving up
+	if (ret == NULL && pmm_shrink(count + pmm_watermarks.high))
+		ret = alloc_pages(count, node);
+	return alloc_done(ret, count);
+}
+
+// Allocates "count" pages starting at a multiple of "align" bytes, which has
+// to be a power of 2 (e.g. HUGE_PAGE_SIZE to back a 2MB page)
+void *pmm_alloc_aligned(size_t count, size_t align) {
+	size_t order = order_for(count);
+	size_t align_order = order_for(align / PAGE_SIZE);
+	if (align_order > order)
+		order = align_order;
+	size_t node = current_node();
+
+	bool ints = lock_irqsave(&pmm_lock);
+	void *ret = node_alloc(count, order, node);
+	if (ret == NULL && order == HUGE_ORDER && huge_reserve_count) {
+		ret = (void *)huge_reserve[--huge_reserve_count];
+		size_t block_pages = (size_t)1 << HUGE_ORDER;
+		if (count < block_pages)
+			free_range((uintptr_t)ret / PAGE_SIZE + count, block_pages - count);
+	}
+	if (ret == NULL)
+		ret = inner_alloc(count, order, node);
+	unlock_irqrestore(&pmm_lock, ints);
+
+	if (ret == NULL && pmm_shrink(((size_t)1 << order) + pmm_watermarks.high)) {
+		ints = lock_irqsave(&pmm_lock);
+		ret = inner_alloc(count, order, node);
+		unlock_irqrestore(&pmm_lock, ints);
 	}
+
+	return alloc_done(ret, count);
+}
+
+static void *zero_pool_get(size_t node) {
+	struct zero_pool *pool = &zero_pools[node];
+	void *ret = NULL;
+	bool ints = lock_irqsave(&pool->lock);
+	if (pool->count)
+		ret = (void *)pool->pages[--pool->count];
+	unlock_irqrestore(&pool->lock, ints);
+	// The pools of other nodes count too, under their own locks
+	if (ret != NULL)
+		__sync_fetch_and_add(&pmm_zero_pool_hits, 1);
+	else
+		__sync_fetch_and_add(&pmm_zero_pool_misses, 1);
 	return ret;
 }
 
+// Zeroes up to PMM_ZERO_POOL_BATCH pages into this node's pool, it's meant to
+// be called when the CPU is idle so it's kept short
+void pmm_zero_pool_refill(void) {
+	size_t node = current_node();
+	struct zero_pool *pool = &zero_pools[node];
+
+	for (size_t i = 0; i < PMM_ZERO_POOL_BATCH; i++) {
+		if (pool->count >= PMM_ZERO_POOL_SIZE ||
+			pmm_free_pages <= pmm_watermarks.high)
+			return;
+
+		void *page = alloc_pages(1, node);
+		if (page == NULL)
+			return;
+
+		// The node ran out, remote pages aren't worth zeroing ahead
+		if (pfn_node((uintptr_t)page / PAGE_SIZE) != node) {
+			free_pages(page, 1);
+			return;
+		}
+
+		memset(page + MEM_PHYS_OFFSET, 0, PAGE_SIZE);
+
+		bool ints = lock_irqsave(&pool->lock);
+		if (pool->count < PMM_ZERO_POOL_SIZE) {
+			pool->pages[pool->count++] = (uintptr_t)page;
+			page = NULL;
+		}
+		unlock_irqrestore(&pool->lock, ints);
+
+		// Someone else filled the pool meanwhile
+		if (page != NULL) {
+			free_pages(page, 1);
+			return;
+		}
+	}
+}
+
 void *pmm_allocz(size_t count) {
+	if (count == 1) {
+		void *page = zero_pool_get(current_node());
+		if (page != NULL)
+			return alloc_done(page, 1);
+	}
+
 	char *ret = (char *)pmm_alloc(count);
 
 	if (ret == NULL)
@@ -114,7 +838,169 @@ void *pmm_allocz(size_t count) {
 }
 
 void pmm_free(void *ptr, size_t count) {
-	size_t page = (size_t)ptr / PAGE_SIZE;
-	for (size_t i = page; i < page + count; i++)
-		bitmap_unset(bitmap, i);
+	pages_set_type((uintptr_t)ptr / PAGE_SIZE, count, PAGE_TYPE_FREE, true);
+	free_pages(ptr, count);
+}
+
+// Tells the page frame database what allocated pages are used for
+void pmm_set_type(void *ptr, size_t count, enum page_type type) {
+	pages_set_type((uintptr_t)ptr / PAGE_SIZE, count, type, false);
+}
+
+// Takes another reference to allocated pages, counted on the first one
+void pmm_get(void *ptr) {
+	struct page *page = phys_to_page((uintptr_t)ptr);
+	if (page != NULL)
+		__sync_fetch_and_add(&page->refcount, 1);
 }
+
+// Drops a reference to allocated pages, they're freed with the last one
+void pmm_put(void *ptr, size_t count) {
+	struct page *page = phys_to_page((uintptr_t)ptr);
+	if (page != NULL && __sync_sub_and_fetch(&page->refcount, 1) == 0)
+		pmm_free(ptr, count);
+}
+
+// Allocations that landed on the allocating CPU's node, and those that didn't
+void pmm_numa_stats(uint64_t *local, uint64_t *remote) {
+	*local = 0;
+	*remote = 0;
+	if (!cpu_caches_enabled)
+		return;
+	for (size_t i = 0; i < return_installed_cpus(); i++) {
+		*local += cpu_locals[i].pmm_cache.numa_local;
+		*remote += cpu_locals[i].pmm_cache.numa_remote;
+	}
+}
+
+// Shrinkers are called in the order they were registered, cheapest first
+void pmm_register_shrinker(struct pmm_shrinker *shrinker) {
+	bool ints = lock_irqsave(&shrinker_lock);
+	shrinker->next = NULL;
+	struct pmm_shrinker **tail = &shrinkers;
+	while (*tail != NULL)
+		tail = &(*tail)->next;
+	*tail = shrinker;
+	unlock_irqrestore(&shrinker_lock, ints);
+}
+
+void pmm_unregister_shrinker(struct pmm_shrinker *shrinker) {
+	bool ints = lock_irqsave(&shrinker_lock);
+	for (struct pmm_shrinker **it = &shrinkers; *it; it = &(*it)->next) {
+		if (*it == shrinker) {
+			*it = shrinker->next;
+			break;
+		}
+	}
+	unlock_irqrestore(&shrinker_lock, ints);
+}
+
+// Asks the shrinkers for "pages" pages, returns how many they gave back. Only
+// one CPU shrinks at a time, the others don't wait for it.
+size_t pmm_shrink(size_t pages) {
+	if (!__sync_bool_compare_and_swap(&shrinking, 0, 1))
+		return 0;
+
+	size_t freed = 0;
+	bool ints = lock_irqsave(&shrinker_lock);
+	for (struct pmm_shrinker *it = shrinkers; it && freed < pages;
+		 it = it->next)
+		freed += it->shrink(pages - freed);
+	unlock_irqrestore(&shrinker_lock, ints);
+
+	shrink_pending = false;
+	UNLOCK(shrinking);
+	return freed;
+}
+
+// Background work for a CPU with nothing to run
+void pmm_idle(void) {
+	if (shrink_pending || pmm_free_pages < pmm_watermarks.low) {
+		if (pmm_free_pages < pmm_watermarks.high)
+			pmm_shrink(pmm_watermarks.high - pmm_free_pages);
+		else
+			shrink_pending = false;
+		return;
+	}
+
+	pmm_zero_pool_refill();
+}
+
+void pmm_get_stats(struct pmm_stats *stats) {
+	stats->free = pmm_free_pages;
+	stats->used = 0;
+	for (size_t type = PAGE_TYPE_KERNEL; type < PAGE_TYPE_COUNT; type++)
+		stats->used += pmm_page_type_counts[type];
+	stats->reserved = pmm_page_type_counts[PAGE_TYPE_RESERVED];
+
+	stats->cached = huge_reserve_count << HUGE_ORDER;
+	for (size_t node = 0; node < PMM_MAX_NODES; node++)
+		stats->cached += zero_pools[node].count;
+	if (cpu_caches_enabled)
+		for (size_t i = 0; i < return_installed_cpus(); i++)
+			stats->cached += cpu_locals[i].pmm_cache.hot_count +
+							 cpu_locals[i].pmm_cache.cold_count;
+}
+
+static size_t zero_pool_shrink(size_t pages) {
+	size_t freed = 0;
+	for (size_t node = 0; node < PMM_MAX_NODES && freed < pages; node++) {
+		struct zero_pool *pool = &zero_pools[node];
+		while (freed < pages) {
+			bool ints = lock_irqsave(&pool->lock);
+			void *page = NULL;
+			if (pool->count)
+				page = (void *)pool->pages[--pool->count];
+			unlock_irqrestore(&pool->lock, ints);
+			if (page == NULL)
+				break;
+			ints = lock_irqsave(&pmm_lock);
+			free_range((uintptr_t)page / PAGE_SIZE, 1);
+			unlock_irqrestore(&pmm_lock, ints);
+			freed++;
+		}
+	}
+	return freed;
+}
+
+// Other CPUs' caches can only be touched by them, so only this one is emptied
+static size_t cache_shrink(size_t pages) {
+	if (!cpu_caches_enabled)
+		return 0;
+
+	bool ints = interrupts_save();
+	struct pmm_cache *cache = &this_cpu->pmm_cache;
+	size_t freed = 0;
+
+	LOCK(pmm_lock);
+	while (freed < pages && cache->cold_count) {
+		free_range(cache->cold[--cache->cold_count] / PAGE_SIZE, 1);
+		freed++;
+	}
+	UNLOCK(pmm_lock);
+
+	size_t hot = cache->hot_count < pages - freed ? cache->hot_count
+												  : pages - freed;
+	if (hot)
+		cache_drain(cache, hot);
+	freed += hot;
+
+	interrupts_restore(ints);
+	return freed;
+}
+
+static size_t reserve_shrink(size_t pages) {
+	size_t freed = 0;
+	bool ints = lock_irqsave(&pmm_lock);
+	while (freed < pages && reserve_release())
+		freed += (size_t)1 << HUGE_ORDER;
+	unlock_irqrestore(&pmm_lock, ints);
+	return freed;
+}
+
+static struct pmm_shrinker zero_pool_shrinker = {.name = "zeroed pages",
+												 .shrink = zero_pool_shrink};
+static struct pmm_shrinker cache_shrinker = {.name = "per-CPU page caches",
+											 .shrink = cache_shrink};
+static struct pmm_shrinker reserve_shrinker = {.name = "huge page reserve",
+											   .shrink = reserve_shrink};
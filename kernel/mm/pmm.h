@@ -19,11 +19,164 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stivale2.h>
 
+// Page frame database: one struct page per frame, kept in arrays of
+// PMM_SECTION_PAGES entries that only exist for sections the PMM manages
+#define PMM_PAGE_SHIFT 12
+#define PMM_SECTION_SHIFT 15
+#define PMM_SECTION_PAGES ((size_t)1 << PMM_SECTION_SHIFT)
+// The section number has to fit in struct page, this covers 8TB
+#define PMM_MAX_SECTIONS 65536
+
+enum page_type {
+	PAGE_TYPE_FREE = 0,
+	PAGE_TYPE_RESERVED,
+	PAGE_TYPE_KERNEL,
+	PAGE_TYPE_PAGE_TABLE,
+	PAGE_TYPE_HEAP,
+	PAGE_TYPE_USER,
+	PAGE_TYPE_COUNT
+};
+
+struct page {
+	uint32_t refcount;
+	uint32_t mapcount;
+	uint16_t flags;
+	uint16_t section;
+	uint8_t type;
+	uint8_t node;
+	uint16_t reserved;
+	void *owner;
+	uintptr_t private;
+};
+
+_Static_assert(sizeof(struct page) <= 32, "struct page must stay small");
+
+extern struct page **pmm_sections;
+extern size_t pmm_section_count;
+// Pages currently owned by each enum page_type, except PAGE_TYPE_FREE
+extern uint64_t pmm_page_type_counts[PAGE_TYPE_COUNT];
+
+static inline struct page *pfn_to_page(size_t pfn) {
+	size_t section = pfn >> PMM_SECTION_SHIFT;
+	if (section >= pmm_section_count || pmm_sections[section] == NULL)
+		return NULL;
+	return &pmm_sections[section][pfn & (PMM_SECTION_PAGES - 1)];
+}
+
+static inline size_t page_to_pfn(struct page *page) {
+	return ((size_t)page->section << PMM_SECTION_SHIFT) +
+		   (size_t)(page - pmm_sections[page->section]);
+}
+
+static inline struct page *phys_to_page(uintptr_t phys) {
+	return pfn_to_page(phys >> PMM_PAGE_SHIFT);
+}
+
+static inline uintptr_t page_to_phys(struct page *page) {
+	return page_to_pfn(page) << PMM_PAGE_SHIFT;
+}
+
+// Biggest block the buddy allocator tracks, 2^18 pages (1GB)
+#define PMM_MAX_ORDER 18
+
+// Per-CPU single page caches: freed pages go to the hot stack, refills from
+// the global allocator go to the cold one, PMM_CACHE_BATCH pages at a time
+#define PMM_CACHE_HIGH 64
+#define PMM_CACHE_BATCH 16
+
+struct pmm_cache {
+	size_t hot_count;
+	size_t cold_count;
+	uintptr_t hot[PMM_CACHE_HIGH];
+	uintptr_t cold[PMM_CACHE_BATCH];
+	// Allocations made by this CPU on its own node and on other ones
+	uint64_t numa_local;
+	uint64_t numa_remote;
+};
+
+// NUMA nodes the PMM keeps separate zones for, from the ACPI SRAT
+#define PMM_MAX_NODES 8
+#define PMM_MAX_NUMA_RANGES 32
+
+struct pmm_numa_range {
+	uintptr_t base;
+	size_t length;
+	size_t node;
+};
+
+extern size_t pmm_node_count;
+
+// Number of 2MB blocks kept aside for pmm_alloc_aligned(), they are only
+// given to other allocations when memory runs out
+#define PMM_HUGE_RESERVE 8
+
+// Single pages pmm_allocz() can take without zeroing them on the spot, per node
+#define PMM_ZERO_POOL_SIZE 256
+#define PMM_ZERO_POOL_BATCH 16
+
+// Bootloader and ACPI reclaimable memory map entries kept for pmm_reclaim()
+#define PMM_MAX_RECLAIMABLE 64
+
+// Free page thresholds, in pages. Below "low" the shrinkers are run when a
+// CPU is idle, below "min" right away by the allocating thread, until free
+// memory is back to "high". "min" is 1/256th of memory within these bounds.
+#define PMM_WATERMARK_MIN_PAGES 128
+#define PMM_WATERMARK_MAX_PAGES 16384
+
+struct pmm_watermarks {
+	size_t min;
+	size_t low;
+	size_t high;
+};
+
+struct pmm_stats {
+	// In the buddy allocators
+	size_t free;
+	// In the per-CPU caches, the zeroed pools and the huge page reserve
+	size_t cached;
+	size_t used;
+	size_t reserved;
+};
+
+// Something holding on to memory it can give back under pressure
+struct pmm_shrinker {
+	const char *name;
+	// Frees up to "pages" pages, returns how many were freed
+	size_t (*shrink)(size_t pages);
+	struct pmm_shrinker *next;
+};
+
+extern size_t pmm_free_pages;
+extern struct pmm_watermarks pmm_watermarks;
+
+// TSC cycles pmm_init() took, the HPET isn't up yet to time it in ns
+extern uint64_t pmm_init_cycles;
+extern uint64_t pmm_zero_pool_hits;
+extern uint64_t pmm_zero_pool_misses;
+
 void *pmm_alloc(size_t count);
+void *pmm_alloc_node(size_t count, size_t node);
 void *pmm_allocz(size_t count);
+void *pmm_alloc_aligned(size_t count, size_t align);
 void pmm_free(void *ptr, size_t count);
+void pmm_set_type(void *ptr, size_t count, enum page_type type);
+void pmm_get(void *ptr);
+void pmm_put(void *ptr, size_t count);
 void pmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries);
+void pmm_reclaim(void);
+void pmm_enable_cpu_caches(void);
+void pmm_numa_init(struct pmm_numa_range *ranges, size_t range_count,
+				   size_t node_count,
+				   uint8_t distances[PMM_MAX_NODES][PMM_MAX_NODES]);
+void pmm_numa_stats(uint64_t *local, uint64_t *remote);
+void pmm_zero_pool_refill(void);
+void pmm_register_shrinker(struct pmm_shrinker *shrinker);
+void pmm_unregister_shrinker(struct pmm_shrinker *shrinker);
+size_t pmm_shrink(size_t pages);
+void pmm_idle(void);
+void pmm_get_stats(struct pmm_stats *stats);
 
 #endif
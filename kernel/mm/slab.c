@@ -0,0 +1,313 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "slab.h"
+#include "../cpu/cpu.h"
+#include "../kernel/panic.h"
+#include "../klibc/lock.h"
+#include "../klibc/math.h"
+#include "../klibc/mem.h"
+#include "pmm.h"
+#include "vmm.h"
+
+// Header at the start of a slab. The struct page of each of its pages points
+// to the cache and to it, so objects are freed without searching
+struct slab {
+	struct slab *prev;
+	struct slab *next;
+	// First free object, the next one is stored at "free_offset" in it
+	void *free;
+	size_t used;
+};
+
+struct kmem_cache {
+	const char *name;
+	// Object size with padding and, with a constructor, the free pointer
+	size_t size;
+	// Where a free object holds the pointer to the next one. Objects made by
+	// a constructor stay constructed while free, so it goes after them
+	size_t free_offset;
+	// Offset of the first object in a slab
+	size_t offset;
+	size_t slab_pages;
+	size_t objects;
+	void (*ctor)(void *);
+	lock_t lock;
+	// Slabs with free objects, slabs without any and slabs with no object in
+	// use, kept to be reused
+	struct slab *partial;
+	struct slab *full;
+	struct slab *empty;
+	size_t empty_count;
+	struct kmem_cache *next;
+};
+
+// The caches made by kmem_cache_create() come from this one
+static struct kmem_cache cache_cache;
+static struct kmem_cache *caches = NULL;
+static lock_t caches_lock;
+
+static void slab_push(struct slab **list, struct slab *slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list != NULL)
+		(*list)->prev = slab;
+	*list = slab;
+}
+
+static void slab_remove(struct slab **list, struct slab *slab) {
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+}
+
+// Allocates a slab and builds its list of free objects, running the
+// constructor on each of them
+static struct slab *slab_new(struct kmem_cache *cache) {
+	size_t bytes = cache->slab_pages * PAGE_SIZE;
+	// Aligned to its size so a slab never straddles a 2MB page
+	void *phys = pmm_alloc_aligned(cache->slab_pages, bytes);
+	if (phys == NULL)
+		return NULL;
+	pmm_set_type(phys, cache->slab_pages, PAGE_TYPE_HEAP);
+	struct slab *slab = phys + MEM_PHYS_OFFSET;
+	for (size_t i = 0; i < cache->slab_pages; i++) {
+		struct page *page = phys_to_page((uintptr_t)phys + i * PAGE_SIZE);
+		page->owner = cache;
+		page->private = (uintptr_t)slab;
+	}
+
+	slab->free = NULL;
+	slab->used = 0;
+	for (size_t i = cache->objects; i-- > 0;) {
+		void *object = (void *)slab + cache->offset + i * cache->size;
+		if (cache->ctor != NULL)
+			cache->ctor(object);
+		*(void **)(object + cache->free_offset) = slab->free;
+		slab->free = object;
+	}
+	return slab;
+}
+
+static void slab_release(struct kmem_cache *cache, struct slab *slab) {
+	pmm_free((void *)slab - MEM_PHYS_OFFSET, cache->slab_pages);
+}
+
+static void cache_init(struct kmem_cache *cache, const char *name, size_t size,
+					   size_t align, void (*ctor)(void *)) {
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	cache->name = name;
+	cache->ctor = ctor;
+	cache->free_offset = 0;
+	if (ctor != NULL) {
+		cache->free_offset = ALIGN_UP(size, sizeof(void *));
+		size = cache->free_offset + sizeof(void *);
+	}
+	cache->size = ALIGN_UP(MAX(size, sizeof(void *)), align);
+	cache->offset = ALIGN_UP(sizeof(struct slab), align);
+	cache->slab_pages = 1;
+	while (cache->slab_pages < SLAB_MAX_PAGES &&
+		   (cache->slab_pages * PAGE_SIZE - cache->offset) / cache->size <
+			   SLAB_MIN_OBJECTS)
+		cache->slab_pages *= 2;
+	cache->objects =
+		(cache->slab_pages * PAGE_SIZE - cache->offset) / cache->size;
+	if (cache->objects == 0)
+		PANIC("Slab cache object too large");
+	cache->lock = 0;
+	cache->partial = NULL;
+	cache->full = NULL;
+	cache->empty = NULL;
+	cache->empty_count = 0;
+}
+
+static size_t slab_shrink(size_t pages) {
+	size_t freed = 0;
+	// Called from page allocations, maybe made with one of the locks held
+	if (!__sync_bool_compare_and_swap(&caches_lock, 0, 1))
+		return 0;
+	for (struct kmem_cache *cache = caches; cache != NULL && freed < pages;
+		 cache = cache->next) {
+		bool ints = interrupts_save();
+		if (!__sync_bool_compare_and_swap(&cache->lock, 0, 1)) {
+			interrupts_restore(ints);
+			continue;
+		}
+		struct slab *empty = cache->empty;
+		cache->empty = NULL;
+		cache->empty_count = 0;
+		UNLOCK(cache->lock);
+		interrupts_restore(ints);
+		while (empty != NULL) {
+			struct slab *next = empty->next;
+			slab_release(cache, empty);
+			freed += cache->slab_pages;
+			empty = next;
+		}
+	}
+	UNLOCK(caches_lock);
+	return freed;
+}
+
+static struct pmm_shrinker slab_shrinker = {.name = "slab caches",
+											.shrink = slab_shrink};
+
+// Creates a cache of objects of "size" bytes aligned to "align", 0 for the
+// pointer size. "ctor", if not NULL, is run on objects when their slab is
+// allocated only, objects have to be freed in their constructed state
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+									 size_t align, void (*ctor)(void *)) {
+	LOCK(caches_lock);
+	if (cache_cache.size == 0) {
+		cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0,
+				   NULL);
+		cache_cache.next = caches;
+		caches = &cache_cache;
+		pmm_register_shrinker(&slab_shrinker);
+	}
+	UNLOCK(caches_lock);
+
+	struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+	if (cache == NULL)
+		return NULL;
+	cache_init(cache, name, size, align, ctor);
+	LOCK(caches_lock);
+	cache->next = caches;
+	caches = cache;
+	UNLOCK(caches_lock);
+	return cache;
+}
+
+// Destroys a cache, every object of it must have been freed
+void kmem_cache_destroy(struct kmem_cache *cache) {
+	if (cache->partial != NULL || cache->full != NULL)
+		PANIC("Destroying a slab cache with objects in use");
+	LOCK(caches_lock);
+	for (struct kmem_cache **prev = &caches; *prev != NULL;
+		 prev = &(*prev)->next) {
+		if (*prev == cache) {
+			*prev = cache->next;
+			break;
+		}
+	}
+	UNLOCK(caches_lock);
+	while (cache->empty != NULL) {
+		struct slab *next = cache->empty->next;
+		slab_release(cache, cache->empty);
+		cache->empty = next;
+	}
+	kmem_cache_free(&cache_cache, cache);
+}
+
+// Allocates an object, the most recently freed one first while it may still
+// be in the cache. NULL if memory ran out
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+	bool ints = interrupts_save();
+	LOCK(cache->lock);
+	struct slab *slab = cache->partial;
+	if (slab == NULL && cache->empty != NULL) {
+		slab = cache->empty;
+		slab_remove(&cache->empty, slab);
+		cache->empty_count--;
+		slab_push(&cache->partial, slab);
+	}
+	if (slab == NULL) {
+		// Don't hold the lock while the PMM may run the shrinker
+		UNLOCK(cache->lock);
+		interrupts_restore(ints);
+		slab = slab_new(cache);
+		if (slab == NULL)
+			return NULL;
+		ints = interrupts_save();
+		LOCK(cache->lock);
+		slab_push(&cache->partial, slab);
+	}
+
+	void *object = slab->free;
+	slab->free = *(void **)(object + cache->free_offset);
+	slab->used++;
+	if (slab->free == NULL) {
+		slab_remove(&cache->partial, slab);
+		slab_push(&cache->full, slab);
+	}
+	UNLOCK(cache->lock);
+	interrupts_restore(ints);
+	return object;
+}
+
+// Allocates an object filled with zeros, for caches without a constructor
+void *kmem_cache_zalloc(struct kmem_cache *cache) {
+	void *object = kmem_cache_alloc(cache);
+	if (object != NULL)
+		memset(object, 0, cache->size);
+	return object;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *object) {
+	if (object == NULL)
+		return;
+	struct page *page = phys_to_page((uintptr_t)object - MEM_PHYS_OFFSET);
+	if (page == NULL || page->owner != cache)
+		PANIC("kmem_cache_free() of an object from another cache");
+	struct slab *slab = (void *)page->private;
+
+	bool ints = interrupts_save();
+	LOCK(cache->lock);
+	if (slab->free == NULL) {
+		slab_remove(&cache->full, slab);
+		slab_push(&cache->partial, slab);
+	}
+	*(void **)(object + cache->free_offset) = slab->free;
+	slab->free = object;
+	slab->used--;
+	struct slab *release = NULL;
+	if (slab->used == 0) {
+		slab_remove(&cache->partial, slab);
+		if (cache->empty_count < SLAB_EMPTY_MAX) {
+			slab_push(&cache->empty, slab);
+			cache->empty_count++;
+		} else {
+			release = slab;
+		}
+	}
+	UNLOCK(cache->lock);
+	interrupts_restore(ints);
+	if (release != NULL)
+		slab_release(cache, release);
+}
+
+void kmem_cache_get_stats(struct kmem_cache *cache,
+						  struct kmem_cache_stats *stats) {
+	stats->objects = 0;
+	bool ints = interrupts_save();
+	LOCK(cache->lock);
+	size_t slabs = cache->empty_count;
+	for (struct slab *slab = cache->partial; slab != NULL; slab = slab->next) {
+		stats->objects += slab->used;
+		slabs++;
+	}
+	for (struct slab *slab = cache->full; slab != NULL; slab = slab->next) {
+		stats->objects += cache->objects;
+		slabs++;
+	}
+	UNLOCK(cache->lock);
+	interrupts_restore(ints);
+	stats->pages = slabs * cache->slab_pages;
+}
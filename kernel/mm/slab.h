@@ -0,0 +1,49 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+
+// A slab is made of enough pages for this many objects, up to SLAB_MAX_PAGES
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_PAGES 16
+// Empty slabs a cache keeps for its next allocations, the shrinker takes
+// them back when memory runs low
+#define SLAB_EMPTY_MAX 2
+
+// A cache of objects of one size, kept in slabs of pages with a list of the
+// free objects of each slab
+struct kmem_cache;
+
+struct kmem_cache_stats {
+	// Objects allocated and not freed
+	size_t objects;
+	// Pages of the cache's slabs, empty ones included
+	size_t pages;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+									 size_t align, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void *kmem_cache_zalloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *object);
+void kmem_cache_get_stats(struct kmem_cache *cache,
+						  struct kmem_cache_stats *stats);
+
+#endif
@@ -0,0 +1,502 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "vma.h"
+#include "../cpu/cpu.h"
+#include "../klibc/lock.h"
+#include "../klibc/math.h"
+#include "../klibc/mem.h"
+#include "../klibc/resource.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <liballoc.h>
+
+uint64_t vma_huge_faults = 0;
+uint64_t vma_huge_collapses = 0;
+
+// The lock is also taken by the page fault handler, interrupts stay off while
+// it's held so a thread holding it can't be preempted by one faulting
+static bool vma_lock(struct pagemap *pagemap) {
+	bool ints = interrupts_save();
+	// The holder may be waiting for this CPU to flush its TLB
+	while (!__sync_bool_compare_and_swap(&pagemap->lock, 0, 1))
+		vmm_tlb_poll();
+	pagemap->lock_count++;
+	return ints;
+}
+
+static void vma_unlock(struct pagemap *pagemap, bool ints) {
+	UNLOCK(pagemap->lock);
+	interrupts_restore(ints);
+}
+
+// Index of the first area ending after "virt_addr", areas are kept sorted and
+// don't overlap
+static int vma_index(struct pagemap *pagemap, uint64_t virt_addr) {
+	int low = 0;
+	int high = pagemap->vmas.length;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		struct vma *vma = pagemap->vmas.data[mid];
+		if (vma->base + vma->length <= virt_addr)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static int vma_insert(struct pagemap *pagemap, int index, struct vma *vma) {
+	if (vec_reserve(&pagemap->vmas, pagemap->vmas.length + 1))
+		return VMM_ENOMEM;
+	// Can't fail once the space is reserved
+	return vec_insert(&pagemap->vmas, index, vma);
+}
+
+// Returns the area containing "virt_addr", the caller holds pagemap->lock
+struct vma *vma_find(struct pagemap *pagemap, uint64_t virt_addr) {
+	int index = vma_index(pagemap, virt_addr);
+	if (index == pagemap->vmas.length)
+		return NULL;
+	struct vma *vma = pagemap->vmas.data[index];
+	return virt_addr >= vma->base ? vma : NULL;
+}
+
+static void vma_get_resource(struct vma *vma) {
+	if (vma->res == NULL)
+		return;
+	bool ints = lock_irqsave(&vma->res->lock);
+	vma->res->refcount++;
+	unlock_irqrestore(&vma->res->lock, ints);
+}
+
+// Frees an area that's no longer in the page map, and what it maps
+static void vma_free(struct pagemap *pagemap, struct vma *vma) {
+	vmm_free_range(pagemap, vma->base, vma->length);
+	if (vma->res != NULL)
+		vma->res->close(vma->res);
+	kfree(vma);
+}
+
+// Splits the area at "index" in two at "virt_addr", which is inside it, the
+// second half goes in "tail". There has to be room for it in the vector
+static void vma_split_into(struct pagemap *pagemap, int index,
+						   uint64_t virt_addr, struct vma *tail) {
+	struct vma *vma = pagemap->vmas.data[index];
+	*tail = *vma;
+	tail->base = virt_addr;
+	tail->length = vma->base + vma->length - virt_addr;
+	tail->offset += virt_addr - vma->base;
+	vma_insert(pagemap, index + 1, tail);
+	vma->length = virt_addr - vma->base;
+	vma_get_resource(tail);
+}
+
+static int vma_split(struct pagemap *pagemap, int index, uint64_t virt_addr) {
+	struct vma *tail = kmalloc(sizeof(struct vma));
+	if (tail == NULL)
+		return VMM_ENOMEM;
+	if (vec_reserve(&pagemap->vmas, pagemap->vmas.length + 1)) {
+		kfree(tail);
+		return VMM_ENOMEM;
+	}
+	vma_split_into(pagemap, index, virt_addr, tail);
+	return 0;
+}
+
+// Splits the areas crossing the bounds of [base, end) so the range is made of
+// whole areas, the first one of them is at "*first"
+static int vma_clip(struct pagemap *pagemap, uint64_t base, uint64_t end,
+					int *first) {
+	int index = vma_index(pagemap, base);
+	if (index < pagemap->vmas.length &&
+		pagemap->vmas.data[index]->base < base) {
+		int ret = vma_split(pagemap, index, base);
+		if (ret)
+			return ret;
+		index++;
+	}
+	*first = index;
+	index = vma_index(pagemap, end);
+	if (index < pagemap->vmas.length &&
+		pagemap->vmas.data[index]->base < end)
+		return vma_split(pagemap, index, end);
+	return 0;
+}
+
+// Adds an anonymous private area, nothing is mapped until it's touched
+int vma_add(struct pagemap *pagemap, uint64_t base, size_t length,
+			uint64_t flags, enum vma_type type) {
+	struct vma area = {
+		.base = base,
+		.length = length,
+		.flags = flags,
+		.type = type,
+	};
+	return vma_add_area(pagemap, &area, true);
+}
+
+// Adds a copy of "area". If "fixed" isn't set, it goes in the first free range
+// between VMA_MMAP_BASE and VMA_MMAP_TOP at or after its base, which is
+// updated; otherwise it goes at its base, which has to be free. Takes a
+// reference to the resource of a file area
+int vma_add_area(struct pagemap *pagemap, struct vma *area, bool fixed) {
+	if ((area->base | area->length) % PAGE_SIZE || area->length == 0)
+		return VMM_EINVAL;
+	struct vma *vma = kmalloc(sizeof(struct vma));
+	if (vma == NULL)
+		return VMM_ENOMEM;
+
+	bool ints = vma_lock(pagemap);
+	uint64_t base = area->base;
+	if (!fixed && (base < VMA_MMAP_BASE || base >= VMA_MMAP_TOP))
+		base = VMA_MMAP_BASE;
+	int index = vma_index(pagemap, base);
+	// Move past the areas in the way
+	while (!fixed && index < pagemap->vmas.length &&
+		   pagemap->vmas.data[index]->base < base + area->length) {
+		base = pagemap->vmas.data[index]->base +
+			   pagemap->vmas.data[index]->length;
+		index++;
+	}
+	int ret = 0;
+	if (!fixed && base + area->length > VMA_MMAP_TOP)
+		ret = VMM_ENOMEM;
+	else if (index < pagemap->vmas.length &&
+			 pagemap->vmas.data[index]->base < base + area->length)
+		ret = VMM_EEXIST;
+	if (ret == 0) {
+		*vma = *area;
+		vma->base = base;
+		ret = vma_insert(pagemap, index, vma);
+	}
+	vma_unlock(pagemap, ints);
+	if (ret) {
+		kfree(vma);
+		return ret;
+	}
+	area->base = base;
+	vma_get_resource(vma);
+	return 0;
+}
+
+// Adds a copy of "area" at its base, replacing the areas there: the range is
+// either all the new area or left as it was. Takes a reference to the
+// resource of a file area
+int vma_replace(struct pagemap *pagemap, struct vma *area) {
+	if ((area->base | area->length) % PAGE_SIZE || area->length == 0)
+		return VMM_EINVAL;
+	struct vma *vma = kmalloc(sizeof(struct vma));
+	if (vma == NULL)
+		return VMM_ENOMEM;
+	*vma = *area;
+	uint64_t end = area->base + area->length;
+
+	bool ints = vma_lock(pagemap);
+	// Splitting keeps the same memory mapped, and once there's room for the
+	// new area nothing can fail
+	int index;
+	int ret = vma_clip(pagemap, area->base, end, &index);
+	if (ret == 0 && vec_reserve(&pagemap->vmas, pagemap->vmas.length + 1))
+		ret = VMM_ENOMEM;
+	while (ret == 0 && index < pagemap->vmas.length &&
+		   pagemap->vmas.data[index]->base < end) {
+		struct vma *old = pagemap->vmas.data[index];
+		vec_splice(&pagemap->vmas, index, 1);
+		vma_free(pagemap, old);
+	}
+	if (ret == 0)
+		ret = vma_insert(pagemap, index, vma);
+	vma_unlock(pagemap, ints);
+	if (ret) {
+		kfree(vma);
+		return ret;
+	}
+	vma_get_resource(vma);
+	return 0;
+}
+
+// Removes a range from the areas overlapping it, splitting them as needed,
+// and drops what they mapped there
+int vma_remove(struct pagemap *pagemap, uint64_t base, size_t length) {
+	if ((base | length) % PAGE_SIZE)
+		return VMM_EINVAL;
+	uint64_t end = base + length;
+
+	bool ints = vma_lock(pagemap);
+	int index;
+	int ret = vma_clip(pagemap, base, end, &index);
+	while (ret == 0 && index < pagemap->vmas.length &&
+		   pagemap->vmas.data[index]->base < end) {
+		struct vma *vma = pagemap->vmas.data[index];
+		vec_splice(&pagemap->vmas, index, 1);
+		vma_free(pagemap, vma);
+	}
+	vma_unlock(pagemap, ints);
+	return ret;
+}
+
+// Removes every area of a page map that's being destroyed
+void vma_remove_all(struct pagemap *pagemap) {
+	struct vma *vma;
+	int i;
+	vec_foreach(&pagemap->vmas, vma, i) {
+		vma_free(pagemap, vma);
+	}
+	vec_deinit(&pagemap->vmas);
+}
+
+// Changes the page table flags of a range, every page of which has to be in
+// an area, and of what's mapped there. The range is changed as a whole or
+// left as it was
+int vma_protect(struct pagemap *pagemap, uint64_t base, size_t length,
+				uint64_t flags) {
+	if ((base | length) % PAGE_SIZE)
+		return VMM_EINVAL;
+	uint64_t end = base + length;
+	// The areas at both ends may be split
+	struct vma *tails[2] = {kmalloc(sizeof(struct vma)),
+							kmalloc(sizeof(struct vma))};
+	size_t used = 0;
+	int ret = tails[0] && tails[1] ? 0 : VMM_ENOMEM;
+
+	bool ints = vma_lock(pagemap);
+	// Look for holes first
+	int first = vma_index(pagemap, base);
+	int index = first;
+	uint64_t covered = base;
+	while (ret == 0 && covered < end && index < pagemap->vmas.length &&
+		   pagemap->vmas.data[index]->base <= covered) {
+		covered = pagemap->vmas.data[index]->base +
+				  pagemap->vmas.data[index]->length;
+		index++;
+	}
+	if (ret == 0 && covered < end)
+		ret = VMM_ENOENT;
+	if (ret == 0 && vec_reserve(&pagemap->vmas, pagemap->vmas.length + 2))
+		ret = VMM_ENOMEM;
+	// Splitting large pages and unsharing page tables is what can run out of
+	// memory in the walk. Do it with the flags the areas already have, then
+	// the walk with the new ones has nothing left to allocate
+	for (int i = first; ret == 0 && i < index; i++) {
+		struct vma *vma = pagemap->vmas.data[i];
+		uint64_t from = MAX(vma->base, base);
+		uint64_t to = MIN(vma->base + vma->length, end);
+		ret = vmm_protect_range(pagemap, from, to - from, vma->flags);
+	}
+	if (ret == 0 && first < pagemap->vmas.length &&
+		pagemap->vmas.data[first]->base < base)
+		vma_split_into(pagemap, first++, base, tails[used++]);
+	index = vma_index(pagemap, end);
+	if (ret == 0 && index < pagemap->vmas.length &&
+		pagemap->vmas.data[index]->base < end)
+		vma_split_into(pagemap, index, end, tails[used++]);
+	for (int i = first; ret == 0 && i < pagemap->vmas.length &&
+						pagemap->vmas.data[i]->base < end;
+		 i++) {
+		struct vma *vma = pagemap->vmas.data[i];
+		vma->flags = flags;
+		ret = vmm_protect_range(pagemap, vma->base, vma->length, flags);
+	}
+	vma_unlock(pagemap, ints);
+	for (; used < 2; used++)
+		if (tails[used] != NULL)
+			kfree(tails[used]);
+	return ret;
+}
+
+// Creates a page map with a copy of the areas of "pagemap", sharing the memory
+// they map copy-on-write unless they're shared. NULL if memory ran out
+struct pagemap *vma_fork(struct pagemap *pagemap) {
+	struct pagemap *child = vmm_new_pagemap();
+	if (child->top_level == NULL) {
+		vmm_destroy_pagemap(child);
+		return NULL;
+	}
+	bool ints = vma_lock(pagemap);
+	int ret = vec_reserve(&child->vmas, pagemap->vmas.length) ? VMM_ENOMEM : 0;
+	struct vma *vma;
+	int i;
+	vec_foreach(&pagemap->vmas, vma, i) {
+		struct vma *copy = ret ? NULL : kmalloc(sizeof(struct vma));
+		if (copy == NULL) {
+			ret = VMM_ENOMEM;
+			break;
+		}
+		*copy = *vma;
+		vma_get_resource(copy);
+		vec_push(&child->vmas, copy);
+		ret = vmm_fork_range(pagemap, child, vma->base, vma->length,
+							 vma->shared);
+	}
+	vma_unlock(pagemap, ints);
+	if (ret) {
+		vmm_destroy_pagemap(child);
+		return NULL;
+	}
+	return child;
+}
+
+// Collapses the fully mapped 2MB blocks of the private anonymous areas of
+// "pagemap" into 2MB pages, at most "max" of them. Returns how many were.
+// Each block is copied with the lock dropped and interrupts on, it's left
+// alone if anything took the lock or wrote to it meanwhile
+size_t vma_collapse(struct pagemap *pagemap, size_t max) {
+	size_t done = 0;
+	// Blocks below this one were tried already
+	uint64_t next = 0;
+	while (done < max) {
+		bool ints = vma_lock(pagemap);
+		struct vmm_collapse collapse;
+		bool found = false;
+		for (int i = vma_index(pagemap, next);
+			 !found && i < pagemap->vmas.length; i++) {
+			struct vma *vma = pagemap->vmas.data[i];
+			if (vma->type != VMA_ANONYMOUS || vma->shared)
+				continue;
+			uint64_t end = vma->base + vma->length;
+			for (uint64_t block =
+					 ALIGN_UP(MAX(vma->base, next), HUGE_PAGE_SIZE);
+				 !found && block + HUGE_PAGE_SIZE <= end;
+				 block += HUGE_PAGE_SIZE) {
+				next = block + HUGE_PAGE_SIZE;
+				found = vmm_collapse_start(pagemap, block, &collapse);
+			}
+		}
+		uint64_t lock_count = pagemap->lock_count;
+		vma_unlock(pagemap, ints);
+		if (!found)
+			break;
+		vmm_collapse_copy(&collapse);
+		ints = vma_lock(pagemap);
+		if (vmm_collapse_finish(pagemap, &collapse,
+								pagemap->lock_count == lock_count + 1))
+			done++;
+		vma_unlock(pagemap, ints);
+	}
+	__sync_fetch_and_add(&vma_huge_collapses, done);
+	return done;
+}
+
+static bool vma_allows(struct vma *vma, uint64_t error_code) {
+	if (!(vma->flags & PTE_PRESENT))
+		return false;
+	if ((error_code & 0x2) && !(vma->flags & PTE_WRITABLE))
+		return false;
+	if ((error_code & 0x4) && !(vma->flags & PTE_USER))
+		return false;
+	if ((error_code & 0x10) && (vma->flags & PTE_NX))
+		return false;
+	return true;
+}
+
+// Whether the whole 2MB block around "page" can be mapped with a 2MB page: it
+// has to be part of a private area and nothing mapped there yet
+static bool huge_allowed(struct pagemap *pagemap, struct vma *vma,
+						 uint64_t page) {
+	uint64_t block = ALIGN_DOWN(page, HUGE_PAGE_SIZE);
+	return !vma->shared && block >= vma->base &&
+		   block + HUGE_PAGE_SIZE <= vma->base + vma->length &&
+		   vmm_huge_unused(pagemap, block);
+}
+
+// A zeroed 2MB page, NULL if 2MB of contiguous memory isn't free. Called
+// without the lock, zeroing it with interrupts off would hold up this CPU
+static void *huge_alloc(void) {
+	void *phys = pmm_alloc_aligned(HUGE_PAGE_SIZE / PAGE_SIZE, HUGE_PAGE_SIZE);
+	if (phys == NULL)
+		return NULL;
+	pmm_set_type(phys, HUGE_PAGE_SIZE / PAGE_SIZE, PAGE_TYPE_USER);
+	memset(phys + MEM_PHYS_OFFSET, 0, HUGE_PAGE_SIZE);
+	return phys;
+}
+
+// Maps "*huge", a zeroed 2MB page if it's set, over the block around "page"
+// if it's still allowed, and a 4KB page otherwise. "*huge" is cleared if it
+// was used
+static bool anonymous_fault(struct pagemap *pagemap, struct vma *vma,
+							uint64_t page, void **huge) {
+	uint64_t block = ALIGN_DOWN(page, HUGE_PAGE_SIZE);
+	if (*huge != NULL && huge_allowed(pagemap, vma, page) &&
+		!vmm_map_range(pagemap, block, (uint64_t)*huge, HUGE_PAGE_SIZE,
+					   vma->flags)) {
+		*huge = NULL;
+		__sync_fetch_and_add(&vma_huge_faults, 1);
+		return true;
+	}
+	void *phys = pmm_allocz(1);
+	if (phys == NULL)
+		return false;
+	pmm_set_type(phys, 1, PAGE_TYPE_USER);
+	if (vmm_map_range(pagemap, page, (uint64_t)phys, PAGE_SIZE, vma->flags)) {
+		pmm_free(phys, 1);
+		return false;
+	}
+	return true;
+}
+
+// Maps the file's own page, private areas get a copy on the first write
+static bool file_fault(struct pagemap *pagemap, struct vma *vma,
+					   uint64_t page) {
+	void *phys = vma->res->mmap(vma->res, vma->offset + (page - vma->base));
+	if (phys == NULL)
+		return false;
+	uint64_t flags = vma->flags;
+	if (!vma->shared)
+		flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+	if (vmm_map_range(pagemap, page, (uint64_t)phys, PAGE_SIZE, flags)) {
+		pmm_put(phys, 1);
+		return false;
+	}
+	return true;
+}
+
+// Handles a fault on a page that isn't present or a write to a copy-on-write
+// page, false if it's not part of an area allowing that access or memory ran
+// out
+bool vma_fault(struct pagemap *pagemap, uint64_t virt_addr,
+			   uint64_t error_code) {
+	bool handled = false;
+	void *huge = NULL;
+	bool ints = vma_lock(pagemap);
+	struct vma *vma = vma_find(pagemap, virt_addr);
+	uint64_t page = ALIGN_DOWN(virt_addr, PAGE_SIZE);
+	// A 2MB page is allocated and zeroed with the lock dropped, the area is
+	// looked up again and the block checked again once it's held
+	if (!(error_code & 0x1) && vma != NULL && vma->type == VMA_ANONYMOUS &&
+		vma_allows(vma, error_code) && huge_allowed(pagemap, vma, page)) {
+		vma_unlock(pagemap, ints);
+		huge = huge_alloc();
+		ints = vma_lock(pagemap);
+		vma = vma_find(pagemap, virt_addr);
+	}
+	if (vma != NULL && vma_allows(vma, error_code)) {
+		if (error_code & 0x1)
+			handled = (error_code & 0x2) && vmm_cow_fault(pagemap, virt_addr);
+		// Another CPU faulting on the same page mapped it first
+		else if (vmm_get_pte(pagemap, page, NULL) != NULL)
+			handled = true;
+		else if (vma->type == VMA_FILE)
+			handled = file_fault(pagemap, vma, page);
+		else
+			handled = anonymous_fault(pagemap, vma, page, &huge);
+	}
+	vma_unlock(pagemap, ints);
+	// Not needed anymore if the block changed meanwhile
+	if (huge != NULL)
+		pmm_free(huge, HUGE_PAGE_SIZE / PAGE_SIZE);
+	return handled;
+}
@@ -0,0 +1,79 @@
+#ifndef VMA_H
+#define VMA_H
+
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../klibc/types.h"
+#include "../klibc/vec.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Areas placed by vma_add_area() go between these, thread stacks are placed
+// above
+#define VMA_MMAP_BASE ((uint64_t)0x100000000000)
+#define VMA_MMAP_TOP ((uint64_t)0x700000000000)
+
+struct pagemap;
+struct resource;
+
+enum vma_type {
+	// Zeroed memory allocated on first touch
+	VMA_ANONYMOUS,
+	// Pages of a file, from the mmap hook of its resource
+	VMA_FILE,
+};
+
+// A virtual memory area, a page aligned range of a page map whose pages are
+// mapped by the page fault handler
+struct vma {
+	uint64_t base;
+	size_t length;
+	// Page table flags the pages are mapped with
+	uint64_t flags;
+	enum vma_type type;
+	// Writes go to memory every page map mapping it sees, forks included,
+	// instead of a private copy
+	bool shared;
+	// VMA_FILE: the file, which the area holds a reference to, and the offset
+	// of "base" in it
+	struct resource *res;
+	off_t offset;
+};
+
+typedef vec_t(struct vma *) vma_vec_t;
+
+// 2MB pages private anonymous areas got on a fault, and from 4KB pages
+// collapsed by vmm_idle()
+extern uint64_t vma_huge_faults;
+extern uint64_t vma_huge_collapses;
+
+int vma_add(struct pagemap *pagemap, uint64_t base, size_t length,
+			uint64_t flags, enum vma_type type);
+int vma_add_area(struct pagemap *pagemap, struct vma *area, bool fixed);
+int vma_replace(struct pagemap *pagemap, struct vma *area);
+int vma_remove(struct pagemap *pagemap, uint64_t base, size_t length);
+void vma_remove_all(struct pagemap *pagemap);
+int vma_protect(struct pagemap *pagemap, uint64_t base, size_t length,
+				uint64_t flags);
+struct pagemap *vma_fork(struct pagemap *pagemap);
+size_t vma_collapse(struct pagemap *pagemap, size_t max);
+struct vma *vma_find(struct pagemap *pagemap, uint64_t virt_addr);
+bool vma_fault(struct pagemap *pagemap, uint64_t virt_addr,
+			   uint64_t error_code);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "vmalloc.h"
+#include "../kernel/panic.h"
+#include "../klibc/lock.h"
+#include "../klibc/math.h"
+#include "../klibc/vec.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <liballoc.h>
+
+struct vmalloc_area {
+	uint64_t base;
+	// Pages mapped, the guard page after them isn't counted
+	size_t count;
+	uint64_t *pages;
+	// Unmapped by vfree(), the range and the pages are reused after the next
+	// flush
+	bool freed;
+	struct vmalloc_area *next;
+};
+
+// Sorted by base address, guarded by vmalloc_lock like the mappings of the
+// range
+static vec_t(struct vmalloc_area *) areas;
+static lock_t vmalloc_lock;
+// Invalidations of the areas vfree() unmapped since the last flush
+static struct tlb_batch lazy_batch;
+static size_t lazy_count;
+// Set by the shrinker, the next vmalloc(), vfree() or vmalloc_idle() purges
+static volatile bool purge_wanted = false;
+
+static void free_pages(uint64_t *pages, size_t count) {
+	for (size_t i = 0; i < count; i++)
+		pmm_free((void *)pages[i], 1);
+	kfree(pages);
+}
+
+// Flushes every TLB of the areas vfree() unmapped and takes them out of the
+// range, they're returned to be freed once vmalloc_lock is dropped
+static struct vmalloc_area *purge(void) {
+	purge_wanted = false;
+	if (lazy_count == 0)
+		return NULL;
+	vmm_tlb_flush(&lazy_batch);
+	struct vmalloc_area *purged = NULL;
+	for (int i = areas.length - 1; i >= 0; i--) {
+		struct vmalloc_area *area = areas.data[i];
+		if (!area->freed)
+			continue;
+		vec_splice(&areas, i, 1);
+		area->next = purged;
+		purged = area;
+	}
+	lazy_count = 0;
+	return purged;
+}
+
+static size_t free_areas(struct vmalloc_area *area) {
+	size_t freed = 0;
+	while (area != NULL) {
+		struct vmalloc_area *next = area->next;
+		free_pages(area->pages, area->count);
+		freed += area->count;
+		kfree(area);
+		area = next;
+	}
+	return freed;
+}
+
+// Finds room for "count" pages and a guard page, returns the index the area
+// goes at or -1
+static int find_gap(size_t count, uint64_t *base) {
+	uint64_t size = (count + 1) * PAGE_SIZE;
+	uint64_t addr = VMALLOC_BASE;
+	for (int i = 0; i < areas.length; i++) {
+		if (areas.data[i]->base - addr >= size) {
+			*base = addr;
+			return i;
+		}
+		addr = areas.data[i]->base + (areas.data[i]->count + 1) * PAGE_SIZE;
+	}
+	if (VMALLOC_TOP - addr < size)
+		return -1;
+	*base = addr;
+	return areas.length;
+}
+
+// Finds the area mapped at "base", -1 if there's none
+static int find_area(uint64_t base) {
+	int low = 0;
+	int high = areas.length;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (areas.data[mid]->base == base)
+			return mid;
+		if (areas.data[mid]->base < base)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return -1;
+}
+
+// Called from page allocations, which may be made with interrupts off and
+// spinlocks held that don't answer TLB shootdowns, so the purge and its
+// shootdown are left to the next vmalloc(), vfree() or vmalloc_idle()
+static size_t vmalloc_shrink(size_t pages) {
+	(void)pages;
+	if (lazy_count)
+		purge_wanted = true;
+	return 0;
+}
+
+static struct pmm_shrinker vmalloc_shrinker = {.name = "vmalloc lazy frees",
+											   .shrink = vmalloc_shrink};
+
+void vmalloc_init(void) {
+	vec_init(&areas);
+	lazy_batch.pagemap = kernel_pagemap;
+	pmm_register_shrinker(&vmalloc_shrinker);
+}
+
+// Allocates zeroed memory that's only virtually contiguous, so it can be
+// backed however fragmented physical memory is. Each allocation is followed
+// by an unmapped guard page. NULL if memory ran out
+void *vmalloc(size_t size) {
+	if (size == 0)
+		return NULL;
+	size_t count = DIV_ROUNDUP(size, PAGE_SIZE);
+	struct vmalloc_area *area = kmalloc(sizeof(struct vmalloc_area));
+	uint64_t *pages = kmalloc(count * sizeof(uint64_t));
+	if (area == NULL || pages == NULL) {
+		kfree(area);
+		kfree(pages);
+		return NULL;
+	}
+	for (size_t i = 0; i < count; i++) {
+		pages[i] = (uint64_t)pmm_allocz(1);
+		if (pages[i] == 0) {
+			free_pages(pages, i);
+			kfree(area);
+			return NULL;
+		}
+		pmm_set_type((void *)pages[i], 1, PAGE_TYPE_HEAP);
+	}
+	area->count = count;
+	area->pages = pages;
+	area->freed = false;
+
+	LOCK(vmalloc_lock);
+	struct vmalloc_area *purged = purge_wanted ? purge() : NULL;
+	int index = find_gap(count, &area->base);
+	if (index < 0 && purged == NULL) {
+		// Ranges vfree() left behind may make room
+		purged = purge();
+		index = find_gap(count, &area->base);
+	}
+	int ret = index < 0 ? VMM_ENOMEM : 0;
+	if (ret == 0 && vec_reserve(&areas, areas.length + 1))
+		ret = VMM_ENOMEM;
+	if (ret == 0)
+		ret = vmm_map_pages(kernel_pagemap, area->base, pages, count,
+							PTE_PRESENT | PTE_WRITABLE);
+	if (ret == 0)
+		// Can't fail once the space is reserved
+		ret = vec_insert(&areas, index, area);
+	else if (index >= 0)
+		// Drop the page tables a partial mapping may have left
+		vmm_unmap_range(kernel_pagemap, area->base, count * PAGE_SIZE);
+	UNLOCK(vmalloc_lock);
+	free_areas(purged);
+
+	if (ret) {
+		free_pages(pages, count);
+		kfree(area);
+		return NULL;
+	}
+	return (void *)area->base;
+}
+
+// Frees memory from vmalloc(). The range is unmapped right away but the TLB
+// flush is put off until VMALLOC_LAZY_MAX pages are waiting for one, the
+// memory is only reused after it
+void vfree(void *ptr) {
+	if (ptr == NULL)
+		return;
+	LOCK(vmalloc_lock);
+	int index = find_area((uint64_t)ptr);
+	if (index < 0 || areas.data[index]->freed)
+		PANIC("vfree() of memory vmalloc() didn't return");
+	struct vmalloc_area *area = areas.data[index];
+	vmm_unmap_range_deferred(kernel_pagemap, area->base,
+							 area->count * PAGE_SIZE, &lazy_batch);
+	area->freed = true;
+	lazy_count += area->count;
+	struct vmalloc_area *purged = NULL;
+	if (lazy_count >= VMALLOC_LAZY_MAX || purge_wanted)
+		purged = purge();
+	UNLOCK(vmalloc_lock);
+	free_areas(purged);
+}
+
+// Called when a CPU has nothing to run, purges if memory ran low since the
+// last purge
+void vmalloc_idle(void) {
+	if (!purge_wanted)
+		return;
+	LOCK(vmalloc_lock);
+	struct vmalloc_area *purged = purge();
+	UNLOCK(vmalloc_lock);
+	free_areas(purged);
+}
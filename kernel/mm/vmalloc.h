@@ -0,0 +1,37 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+/*
+ * Copyright 2021 NSG650
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel range vmalloc() maps allocations in, 1TB above the physical memory
+// mapping; its PML3s are shared by every page map like the rest of the higher
+// half
+#define VMALLOC_BASE ((uint64_t)0xFFFFC00000000000)
+#define VMALLOC_TOP ((uint64_t)0xFFFFC10000000000)
+// Pages vfree() leaves unmapped but possibly cached by a TLB before flushing
+// every TLB at once and reusing them
+#define VMALLOC_LAZY_MAX 8192
+
+void vmalloc_init(void);
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+void vmalloc_idle(void);
+
+#endif
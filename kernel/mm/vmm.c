@@ -16,39 +16,74 @@
  */
 
 #include "vmm.h"
+#include "../cpu/apic.h"
 #include "../cpu/cpu.h"
 #include "../kernel/panic.h"
+#include "../klibc/lock.h"
 #include "../klibc/math.h"
+#include "../klibc/mem.h"
 #include "../klibc/printf.h"
+#include "kstack.h"
 #include "pmm.h"
-#include <cpuid.h>
 #include <liballoc.h>
 
 struct pagemap *kernel_pagemap = NULL;
+uint64_t vmm_init_cycles = 0;
+
+// CPUs that take part in TLB shootdowns
+static volatile uint64_t online_cpus[VMM_MAX_CPUS / 64];
+// Only one shootdown is in flight at a time, "shootdown_pending" counts the
+// CPUs that haven't flushed "shootdown_batch" yet
+static lock_t shootdown_lock;
+static struct tlb_batch *volatile shootdown_batch;
+static volatile size_t shootdown_pending;
+// Taken to hand out a PCID or drop the ones of a page map being destroyed
+static lock_t pcid_lock;
+// Guards the reference counts of page tables shared since a fork
+static lock_t share_lock;
+// Every page map but the kernel's, for vmm_idle()
+static struct pagemap *pagemaps;
+static lock_t pagemaps_lock;
+// Only one CPU at a time goes through the page maps in vmm_idle()
+static lock_t collapse_running;
+static size_t last_collapse_tick;
+
+// Set in CR3 to keep the TLB entries of the PCID loaded
+#define CR3_NOFLUSH ((uint64_t)1 << 63)
+
+static void tlb_shootdown_handler(registers_t *reg);
+static uint64_t *get_next_level(uint64_t *table, size_t entry, int level,
+								bool alloc);
+
+// Maps [base, top) of physical memory both identity mapped and in the higher
+// half, aligned to the biggest page size available
+static void map_physical(uint64_t base, uint64_t top, size_t align) {
+	base = ALIGN_DOWN(base, align);
+	top = ALIGN_UP(top, align);
+	if (vmm_map_range(kernel_pagemap, base, base, top - base, 0b11) ||
+		vmm_map_range(kernel_pagemap, MEM_PHYS_OFFSET + base, base, top - base,
+					  0b11))
+		PANIC("Failed to map physical memory");
+}
 
 void vmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries,
 			  struct stivale2_pmr *pmrs, size_t pmr_entries,
 			  uint64_t virtual_base_address, uint64_t physical_base_address) {
+	uint64_t start = rdtsc();
+	isr_register_handler(VMM_SHOOTDOWN_VECTOR, tlb_shootdown_handler);
 	kernel_pagemap = vmm_new_pagemap();
-	// Use the biggest page size available
-	uint32_t a = 0, b = 0, c = 0, d = 0;
-	if (__get_cpuid(0x80000001, &a, &b, &c, &d)) {
-		if (d & CPUID_GBPAGE) {
-			// Use 1GB pages if available (biggest size on x86-64)
-			for (uint64_t p = 0; p < 4096UL * 1024 * 1024; p += 0x40000000) {
-				vmm_map_page(kernel_pagemap, p, p, 0b11, false, true);
-				vmm_map_page(kernel_pagemap, p + MEM_PHYS_OFFSET, p, 0b11,
-							 false, true);
-			}
-		} else {
-			// Use 2MB pages otherwise (biggest size always available on x86-64)
-			for (uint64_t p = 0; p < 4096UL * 1024 * 1024; p += 0x200000) {
-				vmm_map_page(kernel_pagemap, p, p, 0b11, true, false);
-				vmm_map_page(kernel_pagemap, p + MEM_PHYS_OFFSET, p, 0b11, true,
-							 false);
-			}
-		}
-	}
+	if (kernel_pagemap->top_level == NULL)
+		PANIC("Failed to allocate the kernel page map");
+	// Allocate every higher half PML3 now, so the PML4 entries copied into
+	// new page maps never change
+	uint64_t *top_level = kernel_pagemap->top_level + MEM_PHYS_OFFSET;
+	for (size_t i = 256; i < 512; i++)
+		if (get_next_level(top_level, i, 4, true) == NULL)
+			PANIC("Failed to allocate the kernel page map");
+	// vmm_map_range() uses the biggest page size available, 1GB pages if
+	// supported and 2MB pages otherwise
+	size_t align = cpu_has(CPU_FEATURE_GBPAGE) ? GB_PAGE_SIZE : HUGE_PAGE_SIZE;
+	map_physical(0, 4096UL * 1024 * 1024, align);
 	// Map PMRs with 4KB granularity
 	for (size_t i = 0; i < pmr_entries; i++) {
 		uint64_t virt = pmrs[i].base;
@@ -56,135 +91,1124 @@ void vmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries,
 		uint64_t phys = physical_base_address + (virt - virtual_base_address);
 		// Convert Stivale2's PMR permissions format to page permissions format
 		uint64_t pf =
-			(pmrs[i].permissions & STIVALE2_PMR_EXECUTABLE ? 0 : 1UL << 63) |
-			(pmrs[i].permissions & STIVALE2_PMR_WRITABLE ? 1 << 1 : 0) | 1;
-		for (uint64_t p = 0; p < pmrs[i].length; p += PAGE_SIZE) {
-			vmm_map_page(kernel_pagemap, virt + p, phys + p, pf, false, false);
-		}
-	}
-	// Use the biggest page size available for the memory map, align to that
-	// size
-	if (__get_cpuid(0x80000001, &a, &b, &c, &d)) {
-		if (d & CPUID_GBPAGE) {
-			for (size_t i = 0; i < memmap_entries; i++) {
-				// Align to 1GB
-				// 1GB = 1073741824 (bytes) = 0x40000000 (bytes in hexadecimal)
-				uint64_t aligned_base = ALIGN_DOWN(memmap[i].base, 0x40000000);
-				uint64_t aligned_top =
-					ALIGN_UP(memmap[i].base + memmap[i].length, 0x40000000);
-				uint64_t aligned_length = aligned_top - aligned_base;
-
-				// Map the entire memory map based on the aligned length
-				for (uint64_t p = 0; p < aligned_length; p += 0x40000000) {
-					uint64_t page = aligned_base + p;
-					vmm_map_page(kernel_pagemap, page, page, 0b11, false, true);
-					vmm_map_page(kernel_pagemap, MEM_PHYS_OFFSET + page, page,
-								 0b11, false, true);
-				}
-			}
-		} else {
-			for (size_t i = 0; i < memmap_entries; i++) {
-				// Align to 2MB
-				// 2MB = 2097152 (bytes) = 0x200000 (bytes in hexadecimal)
-				uint64_t aligned_base = ALIGN_DOWN(memmap[i].base, 0x200000);
-				uint64_t aligned_top =
-					ALIGN_UP(memmap[i].base + memmap[i].length, 0x200000);
-				uint64_t aligned_length = aligned_top - aligned_base;
-
-				for (uint64_t p = 0; p < aligned_length; p += 0x200000) {
-					uint64_t page = aligned_base + p;
-					vmm_map_page(kernel_pagemap, page, page, 0b11, true, false);
-					vmm_map_page(kernel_pagemap, MEM_PHYS_OFFSET + page, page,
-								 0b11, true, false);
-				}
-			}
-		}
+			(pmrs[i].permissions & STIVALE2_PMR_EXECUTABLE ? 0 : PTE_NX) |
+			(pmrs[i].permissions & STIVALE2_PMR_WRITABLE ? PTE_WRITABLE : 0) |
+			PTE_PRESENT;
+		if (vmm_map_range(kernel_pagemap, virt, phys, pmrs[i].length, pf))
+			PANIC("Failed to map the kernel");
 	}
+	// Map the memory map, aligned to the biggest page size available
+	for (size_t i = 0; i < memmap_entries; i++)
+		map_physical(memmap[i].base, memmap[i].base + memmap[i].length, align);
 	// Switch to the new page map, dropping Stivale2's default one
 	vmm_switch_pagemap(kernel_pagemap);
+	vmm_init_cycles = rdtsc() - start;
+}
+
+// Returns the PCID of "pagemap" on this CPU for CR3, with the bit keeping
+// its TLB entries if they're still valid. Out of PCIDs, the least recently
+// handed out one is taken back from its page map
+static uint64_t pcid_get(struct pagemap *pagemap, size_t cpu) {
+	struct pagemap **owners = this_cpu->pcid_owners;
+	uint64_t *stale = this_cpu->pcid_stale;
+	uint16_t pcid = pagemap->pcids[cpu];
+	if (pcid != 0 && owners[pcid] == pagemap) {
+		if (!(stale[pcid / 64] & (1UL << (pcid % 64))))
+			return pcid | CR3_NOFLUSH;
+		stale[pcid / 64] &= ~(1UL << (pcid % 64));
+		return pcid;
+	}
+	LOCK(pcid_lock);
+	pcid = this_cpu->pcid_next;
+	this_cpu->pcid_next = pcid % (VMM_PCID_COUNT - 1) + 1;
+	struct pagemap *evicted = owners[pcid];
+	if (evicted != NULL) {
+		// Its entries go with the CR3 write, shootdowns can skip this CPU
+		evicted->pcids[cpu] = 0;
+		__sync_fetch_and_and(&evicted->active_cpus[cpu / 64],
+							 ~(1UL << (cpu % 64)));
+	}
+	owners[pcid] = pagemap;
+	pagemap->pcids[cpu] = pcid;
+	stale[pcid / 64] &= ~(1UL << (pcid % 64));
+	UNLOCK(pcid_lock);
+	return pcid;
 }
 
 void vmm_switch_pagemap(struct pagemap *pagemap) {
-	asm volatile("mov cr3, %0" : : "r"(pagemap->top_level) : "memory");
+	// Before SMP there's no CPU local data and no one to shoot down
+	if (cpu_locals == NULL) {
+		asm volatile("mov cr3, %0" : : "r"(pagemap->top_level) : "memory");
+		return;
+	}
+	bool ints = interrupts_save();
+	size_t cpu = this_cpu->cpu_number;
+	struct pagemap *old = this_cpu->pagemap;
+	if (old == pagemap) {
+		interrupts_restore(ints);
+		return;
+	}
+	// Set before loading it, a shootdown can't miss this CPU
+	__sync_fetch_and_or(&pagemap->active_cpus[cpu / 64], 1UL << (cpu % 64));
+	if (this_cpu->pcid_owners != NULL) {
+		uint64_t cr3 = (uint64_t)pagemap->top_level | pcid_get(pagemap, cpu);
+		asm volatile("mov cr3, %0" : : "r"(cr3) : "memory");
+		this_cpu->pagemap = pagemap;
+		// The old page map keeps its PCID and its entries in the TLB, so it
+		// stays active here to still get shootdowns
+	} else {
+		asm volatile("mov cr3, %0" : : "r"(pagemap->top_level) : "memory");
+		this_cpu->pagemap = pagemap;
+		if (old != NULL)
+			__sync_fetch_and_and(&old->active_cpus[cpu / 64],
+								 ~(1UL << (cpu % 64)));
+	}
+	interrupts_restore(ints);
+}
+
+// Called once the CPU's local APIC can receive shootdown IPIs
+void vmm_cpu_online(void) {
+	size_t cpu = this_cpu->cpu_number;
+	ASSERT(cpu < VMM_MAX_CPUS);
+	// wsmp_cpu_init() enabled PCIDs if supported, they're handed out from
+	// the next page map switch on
+	if (read_cr("4") & (1 << 17)) {
+		this_cpu->pcid_owners =
+			kcalloc(VMM_PCID_COUNT, sizeof(struct pagemap *));
+		this_cpu->pcid_next = 1;
+	}
+	__sync_fetch_and_or(&online_cpus[cpu / 64], 1UL << (cpu % 64));
+	// Drop whatever was cached before shootdowns reached this CPU
+	write_cr("3", read_cr("3"));
 }
 
-// Creates a new dynamically allocated page map
+// Creates a new dynamically allocated page map, sharing the kernel's higher
+// half
 struct pagemap *vmm_new_pagemap(void) {
-	struct pagemap *pagemap = kmalloc(sizeof(struct pagemap));
+	struct pagemap *pagemap = kcalloc(1, sizeof(struct pagemap));
 	pagemap->top_level = pmm_allocz(1);
+	if (pagemap->top_level == NULL)
+		return pagemap;
+	pmm_set_type(pagemap->top_level, 1, PAGE_TYPE_PAGE_TABLE);
+	if (kernel_pagemap != NULL) {
+		uint64_t *top_level = pagemap->top_level + MEM_PHYS_OFFSET;
+		uint64_t *kernel_top = kernel_pagemap->top_level + MEM_PHYS_OFFSET;
+		for (size_t i = 256; i < 512; i++)
+			top_level[i] = kernel_top[i];
+		bool ints = vmm_lock_irqsave(&pagemaps_lock);
+		pagemap->next = pagemaps;
+		pagemaps = pagemap;
+		unlock_irqrestore(&pagemaps_lock, ints);
+	}
 	return pagemap;
 }
 
-static uint64_t *get_next_level(uint64_t *current_level, size_t entry) {
-	uint64_t *ret;
-	if (current_level[entry] & 1) {
-		// Present flag set
-		ret = (uint64_t *)(size_t)(current_level[entry] & ~((uint64_t)0xFFF));
-	} else {
-		// Allocate a table for the next level
-		ret = pmm_allocz(1);
-		// Present + writable + user (0b111)
-		current_level[entry] = (size_t)ret | 0b111;
+// Levels are numbered like the tables: 4 is the PML4, 1 maps 4KB pages
+static inline size_t level_shift(int level) {
+	return 12 + 9 * (level - 1);
+}
+
+static inline size_t level_index(uint64_t virt, int level) {
+	return (virt >> level_shift(level)) & 0x1FF;
+}
+
+static inline uint64_t *table_virt(uint64_t entry) {
+	return (uint64_t *)((entry & PTE_ADDR_MASK) + MEM_PHYS_OFFSET);
+}
+
+static uint64_t *alloc_table(void) {
+	uint64_t *table = pmm_allocz(1);
+	if (table)
+		pmm_set_type(table, 1, PAGE_TYPE_PAGE_TABLE);
+	return table;
+}
+
+// Flags of the entries of the table replacing the large page "old" of a table
+// of "level", which map it with the next smaller page size
+static uint64_t split_flags(uint64_t old, int level) {
+	uint64_t flags = old & ~PTE_ADDR_MASK;
+	// The PAT bit moves from bit 12 to bit 7 (the size bit) in 4KB entries
+	if (level - 1 == 1)
+		return (flags & ~PTE_HUGE) | (old & PTE_PAT_HUGE ? PTE_PAT : 0);
+	return flags | (old & PTE_PAT_HUGE);
+}
+
+// Replaces the 1GB or 2MB page mapped by "entry" in a table of "level" by a
+// table mapping the same memory with the next smaller page size
+static uint64_t *split_large_page(uint64_t *entry, int level) {
+	uint64_t *table = alloc_table();
+	if (table == NULL)
+		return NULL;
+	uint64_t *virt = (void *)table + MEM_PHYS_OFFSET;
+	uint64_t old = *entry;
+	size_t size = (size_t)1 << level_shift(level - 1);
+	uint64_t phys = ALIGN_DOWN(old & PTE_ADDR_MASK, size * 512);
+	uint64_t flags = split_flags(old, level);
+	for (size_t i = 0; i < 512; i++)
+		virt[i] = (phys + i * size) | flags;
+	// Present + writable + user (0b111), the leaves hold the real permissions
+	*entry = (uint64_t)table | 0b111;
+	return virt;
+}
+
+// Returns the table referenced by "entry" of a table of "level", through the
+// higher half; a missing table is allocated if "alloc" is set and a large
+// page in the way is split. Returns NULL without touching the entry on failure.
+// A table shared since a fork has to be unshared first to be changed
+static uint64_t *get_next_level(uint64_t *table, size_t entry, int level,
+								bool alloc) {
+	if (table[entry]) {
+		if (level == 4 || !(table[entry] & PTE_HUGE))
+			return table_virt(table[entry]);
+		return split_large_page(&table[entry], level);
 	}
+	if (!alloc)
+		return NULL;
+	uint64_t *next = alloc_table();
+	if (next == NULL)
+		return NULL;
+	// Present + writable + user (0b111)
+	table[entry] = (uint64_t)next | 0b111;
+	return (void *)next + MEM_PHYS_OFFSET;
+}
 
-	return ret;
+static void free_tables(uint64_t *table, int level) {
+	if (level > 1) {
+		for (size_t i = 0; i < 512; i++)
+			if ((table[i] & PTE_PRESENT) && !(table[i] & PTE_HUGE))
+				free_tables(table_virt(table[i]), level - 1);
+	}
+	pmm_free((void *)table - MEM_PHYS_OFFSET, 1);
 }
 
-// Maps a page, without the present bit in "flags" (bit 0), unmaps a page;
-// the argument "gbpages" has more priority than "hugepages", meaning that if
-// "hugepages" and "gbpages" are true, and if 1GB pages are available,
-// uses 1GB pages, if 1GB pages aren't available, uses 2MB pages
-bool vmm_map_page(struct pagemap *pagemap, uint64_t virt_addr,
-				  uint64_t phys_addr, uint64_t flags, bool hugepages,
-				  bool gbpages) {
-	size_t pml4_entry = (virt_addr & ((uint64_t)0x1FF << 39)) >> 39;
-	size_t pml3_entry = (virt_addr & ((uint64_t)0x1FF << 30)) >> 30;
-	size_t pml2_entry = (virt_addr & ((uint64_t)0x1FF << 21)) >> 21;
-	size_t pml1_entry = (virt_addr & ((uint64_t)0x1FF << 12)) >> 12;
+// Frees a page map and its lower half page tables, not the memory it maps;
+// no CPU may have it loaded
+void vmm_destroy_pagemap(struct pagemap *pagemap) {
+	// PCIDs it still holds get flushed when handed out again
+	LOCK(pcid_lock);
+	for (size_t cpu = 0; cpu < VMM_MAX_CPUS; cpu++) {
+		if (!(pagemap->active_cpus[cpu / 64] & (1UL << (cpu % 64))))
+			continue;
+		ASSERT(cpu_locals[cpu].pagemap != pagemap);
+		uint16_t pcid = pagemap->pcids[cpu];
+		if (pcid != 0 && cpu_locals[cpu].pcid_owners[pcid] == pagemap)
+			cpu_locals[cpu].pcid_owners[pcid] = NULL;
+	}
+	UNLOCK(pcid_lock);
+	// Waits for vmm_idle() to be done with it
+	bool ints = vmm_lock_irqsave(&pagemaps_lock);
+	while (pagemap->collapsing) {
+		unlock_irqrestore(&pagemaps_lock, ints);
+		asm volatile("pause");
+		ints = vmm_lock_irqsave(&pagemaps_lock);
+	}
+	for (struct pagemap **link = &pagemaps; *link != NULL;
+		 link = &(*link)->next) {
+		if (*link == pagemap) {
+			*link = pagemap->next;
+			break;
+		}
+	}
+	unlock_irqrestore(&pagemaps_lock, ints);
+	vma_remove_all(pagemap);
+	if (pagemap->top_level) {
+		uint64_t *top_level = pagemap->top_level + MEM_PHYS_OFFSET;
+		for (size_t i = 0; i < 256; i++)
+			if (top_level[i] & PTE_PRESENT)
+				free_tables(table_virt(top_level[i]), 3);
+		pmm_free(pagemap->top_level, 1);
+	}
+	kfree(pagemap);
+}
+
+static void invpcid(uint64_t type, uint64_t pcid, uint64_t virt) {
+	struct {
+		uint64_t pcid;
+		uint64_t virt;
+	} descriptor = {pcid, virt};
+	asm volatile("invpcid %0, %1" : : "r"(type), "m"(descriptor) : "memory");
+}
+
+// Drops the batch from the TLB entries a page map that isn't loaded left
+// under its PCID, or has them flushed when it's loaded again
+static void pcid_flush(struct tlb_batch *batch) {
+	size_t cpu = this_cpu->cpu_number;
+	uint16_t pcid = batch->pagemap->pcids[cpu];
+	if (this_cpu->pcid_owners == NULL || pcid == 0 ||
+		this_cpu->pcid_owners[pcid] != batch->pagemap)
+		return;
+	if (!cpu_has(CPU_FEATURE_INVPCID)) {
+		this_cpu->pcid_stale[pcid / 64] |= 1UL << (pcid % 64);
+		return;
+	}
+	if (batch->count > VMM_TLB_BATCH_MAX) {
+		invpcid(1, pcid, 0); // Single context
+		return;
+	}
+	for (size_t i = 0; i < batch->count; i++)
+		invpcid(0, pcid, batch->pages[i]); // Individual address
+}
+
+// Flushes every TLB entry, global ones and those of every PCID included
+static void tlb_flush_all(void) {
+	if (cpu_has(CPU_FEATURE_INVPCID)) {
+		invpcid(2, 0, 0); // All contexts, global entries included
+		return;
+	}
+	uint64_t cr4 = read_cr("4");
+	write_cr("4", cr4 & ~(1 << 7));
+	write_cr("4", cr4);
+}
+
+static void tlb_flush_local(struct tlb_batch *batch) {
+	bool loaded = cpu_locals == NULL || this_cpu->pagemap == batch->pagemap;
+	if (!loaded)
+		pcid_flush(batch);
+	// Higher half entries are global, invlpg flushes them whatever page map
+	// is loaded
+	if (!loaded && !batch->kernel)
+		return;
+	if (batch->count > VMM_TLB_BATCH_MAX) {
+		if (batch->kernel)
+			tlb_flush_all();
+		else
+			write_cr("3", read_cr("3"));
+		return;
+	}
+	for (size_t i = 0; i < batch->count; i++)
+		asm volatile("invlpg [%0]" : : "r"(batch->pages[i]) : "memory");
+}
+
+// Flushes the batch of the shootdown in flight if it's waiting for this CPU,
+// for code spinning with interrupts off
+void vmm_tlb_poll(void) {
+	if (!__sync_bool_compare_and_swap(&this_cpu->tlb_shootdown, true, false))
+		return;
+	tlb_flush_local(shootdown_batch);
+	__sync_fetch_and_sub(&shootdown_pending, 1);
+}
 
-	uint64_t *pml4, *pml3, *pml2, *pml1;
+// Takes "lock" with interrupts off for locks held across TLB shootdowns: a
+// CPU spinning on it keeps answering them, or the holder would wait for it
+// forever
+bool vmm_lock_irqsave(lock_t *lock) {
+	bool ints = interrupts_save();
+	while (!__sync_bool_compare_and_swap(lock, 0, 1))
+		vmm_tlb_poll();
+	return ints;
+}
+
+static void tlb_shootdown_handler(registers_t *reg) {
+	(void)reg;
+	vmm_tlb_poll();
+}
+
+void vmm_tlb_add(struct tlb_batch *batch, uint64_t virt_addr) {
+	if (virt_addr >= MEM_PHYS_OFFSET)
+		batch->kernel = true;
+	if (batch->count < VMM_TLB_BATCH_MAX)
+		batch->pages[batch->count] = virt_addr;
+	batch->count++;
+}
+
+static void tlb_shootdown(struct tlb_batch *batch) {
+	bool ints = interrupts_save();
+	// Before SMP only this CPU exists
+	if (cpu_locals == NULL) {
+		tlb_flush_local(batch);
+		interrupts_restore(ints);
+		return;
+	}
+	// Order the page table writes before reading which CPUs to target
+	__sync_synchronize();
+	// Keep answering other shootdowns while waiting, interrupts may be off
+	while (!__sync_bool_compare_and_swap(&shootdown_lock, 0, 1))
+		vmm_tlb_poll();
+	size_t self = this_cpu->cpu_number;
+	bool all = batch->kernel || batch->pagemap == kernel_pagemap;
+	shootdown_batch = batch;
+	shootdown_pending = 0;
+	for (size_t cpu = 0; cpu < VMM_MAX_CPUS; cpu++) {
+		uint64_t bit = 1UL << (cpu % 64);
+		if (cpu == self || !(online_cpus[cpu / 64] & bit))
+			continue;
+		if (!all && !(batch->pagemap->active_cpus[cpu / 64] & bit))
+			continue;
+		__sync_fetch_and_add(&shootdown_pending, 1);
+		cpu_locals[cpu].tlb_shootdown = true;
+		// Fixed delivery, level assert
+		apic_send_ipi(cpu_locals[cpu].lapic_id,
+					  VMM_SHOOTDOWN_VECTOR | (1 << 14));
+	}
+	if (all || batch->pagemap->active_cpus[self / 64] & (1UL << (self % 64)))
+		tlb_flush_local(batch);
+	while (shootdown_pending)
+		asm volatile("pause");
+	UNLOCK(shootdown_lock);
+	interrupts_restore(ints);
+}
 
-	// Allocate page map levels
-	pml4 = pagemap->top_level;
-	pml3 = get_next_level(pml4, pml4_entry);
-	if (pml3 == NULL)
+// Flushes the batch on this CPU and with one IPI on each other CPU that has
+// the page map loaded, then frees the page tables the batch unlinked
+void vmm_tlb_flush(struct tlb_batch *batch) {
+	if (batch->count)
+		tlb_shootdown(batch);
+	for (size_t i = 0; i < batch->free_page_count; i++)
+		pmm_put((void *)batch->free_pages[i].phys, batch->free_pages[i].count);
+	batch->free_page_count = 0;
+	while (batch->free_tables != NULL) {
+		uint64_t *table = batch->free_tables + MEM_PHYS_OFFSET;
+		batch->free_tables = (void *)*table;
+		*table = 0;
+		pmm_free((void *)table - MEM_PHYS_OFFSET, 1);
+	}
+	batch->count = 0;
+	batch->kernel = false;
+}
+
+static bool table_empty(uint64_t *table) {
+	for (size_t i = 0; i < 512; i++)
+		if (table[i])
+			return false;
+	return true;
+}
+
+enum range_op { RANGE_MAP, RANGE_UNMAP, RANGE_FREE, RANGE_PROTECT };
+
+struct range_walk {
+	enum range_op op;
+	uint64_t virt;
+	uint64_t phys;
+	// RANGE_MAP: physical addresses of the 4KB pages to map one after the
+	// other instead of "phys" onwards, if set
+	const uint64_t *pages;
+	// Bytes left, the range can end at the top of the address space
+	size_t left;
+	uint64_t flags;
+	struct tlb_batch batch;
+};
+
+// Physical address of the page mapped by the leaf "entry" of a table of
+// "level", the PAT bit of large pages is in the address bits
+static inline uint64_t leaf_phys(uint64_t entry, int level) {
+	return ALIGN_DOWN(entry & PTE_ADDR_MASK, (size_t)1 << level_shift(level));
+}
+
+// Queues a reference to the memory mapped by a leaf of "level" to be dropped
+// after the flush, freeing it if it was the last one
+static void batch_free_page(struct tlb_batch *batch, uint64_t entry,
+							int level) {
+	// Out of room, flush now to free what's queued
+	if (batch->free_page_count == VMM_TLB_BATCH_MAX)
+		vmm_tlb_flush(batch);
+	size_t size = (size_t)1 << level_shift(level);
+	batch->free_pages[batch->free_page_count].phys = leaf_phys(entry, level);
+	batch->free_pages[batch->free_page_count].count = size / PAGE_SIZE;
+	batch->free_page_count++;
+}
+
+// Queues a page table unlinked from the page map to be freed after the flush,
+// the link to the next one isn't a present entry
+static void batch_free_table(struct tlb_batch *batch, uint64_t *table) {
+	*table = (uint64_t)batch->free_tables;
+	batch->free_tables = (void *)table - MEM_PHYS_OFFSET;
+}
+
+// Page tables are shared by a fork only through PML2 entries: each page map
+// using the table holds a reference to it, counted on its struct page, and
+// the table and the pages it maps are read-only through the entry
+static inline bool table_shared(uint64_t entry, int level) {
+	return level == 2 && (entry & PTE_PRESENT) && !(entry & PTE_HUGE) &&
+		   (entry & PTE_COW);
+}
+
+// Gives the page map owning the PML2 "entry" mapping "virt" its own copy of
+// the table shared since a fork, or takes it back if no other page map uses
+// it anymore. The pages it maps are then copy-on-write in both tables
+static uint64_t *unshare_table(uint64_t *entry, struct tlb_batch *batch,
+							   uint64_t virt) {
+	uint64_t *table = table_virt(*entry);
+	struct page *page = phys_to_page(*entry & PTE_ADDR_MASK);
+	LOCK(share_lock);
+	if (page->refcount == 1) {
+		*entry = (*entry & ~PTE_COW) | PTE_WRITABLE;
+		UNLOCK(share_lock);
+		return table;
+	}
+	uint64_t *copy = alloc_table();
+	if (copy == NULL) {
+		UNLOCK(share_lock);
+		return NULL;
+	}
+	copy = (void *)copy + MEM_PHYS_OFFSET;
+	for (size_t i = 0; i < 512; i++) {
+		if (table[i]) {
+			table[i] = (table[i] & ~PTE_WRITABLE) | PTE_COW;
+			pmm_get((void *)leaf_phys(table[i], 1));
+		}
+		copy[i] = table[i];
+	}
+	page->refcount--;
+	*entry = ((uint64_t)copy - MEM_PHYS_OFFSET) | 0b111;
+	UNLOCK(share_lock);
+	// Other CPUs may still walk the shared table through this page map, it's
+	// freed once the last page map using it is done with it
+	vmm_tlb_add(batch, virt);
+	return copy;
+}
+
+// Drops the reference of the page map owning the PML2 "entry" mapping "virt"
+// to a table shared since a fork, without copying it. The last one frees it,
+// along with the memory it maps if "free" is set
+static void release_table(uint64_t *entry, struct tlb_batch *batch,
+						  uint64_t virt, bool free) {
+	uint64_t *table = table_virt(*entry);
+	struct page *page = phys_to_page(*entry & PTE_ADDR_MASK);
+	*entry = 0;
+	vmm_tlb_add(batch, virt);
+	for (size_t i = 0; i < 512; i++)
+		if (table[i] & PTE_PRESENT)
+			vmm_tlb_add(batch, virt + i * PAGE_SIZE);
+	LOCK(share_lock);
+	bool last = page->refcount == 1;
+	if (!last)
+		page->refcount--;
+	UNLOCK(share_lock);
+	if (!last)
+		return;
+	for (size_t i = 0; free && i < 512; i++)
+		if (table[i])
+			batch_free_page(batch, table[i], 1);
+	batch_free_table(batch, table);
+}
+
+// Gives the 2MB leaf "entry" mapping "virt" its own copy of the page as a
+// table of 4KB pages with the same flags, each with its own reference count
+static bool copy_leaf_split(uint64_t *entry, struct tlb_batch *batch,
+							uint64_t virt) {
+	uint64_t phys = leaf_phys(*entry, 2);
+	uint64_t *table = alloc_table();
+	if (table == NULL)
 		return false;
+	uint64_t *copies = (void *)table + MEM_PHYS_OFFSET;
+	uint64_t flags = split_flags(*entry, 2);
+	for (size_t i = 0; i < 512; i++) {
+		void *copy = pmm_alloc(1);
+		if (copy == NULL) {
+			while (i--)
+				pmm_free((void *)(copies[i] & PTE_ADDR_MASK), 1);
+			pmm_free(table, 1);
+			return false;
+		}
+		pmm_set_type(copy, 1, PAGE_TYPE_USER);
+		memcpy(copy + MEM_PHYS_OFFSET,
+			   (void *)phys + i * PAGE_SIZE + MEM_PHYS_OFFSET, PAGE_SIZE);
+		copies[i] = (uint64_t)copy | flags;
+	}
+	batch_free_page(batch, *entry, 2);
+	// Present + writable + user (0b111), the leaves hold the real permissions
+	*entry = (uint64_t)table | 0b111;
+	vmm_tlb_add(batch, ALIGN_DOWN(virt, (size_t)1 << level_shift(2)));
+	return true;
+}
+
+// Gives the leaf "entry" of a table of "level" mapping "virt" its own copy of
+// the page, with the same flags. A 2MB page is copied as 4KB pages if there's
+// no free 2MB block, "entry" then references a table
+static bool copy_leaf(uint64_t *entry, int level, struct tlb_batch *batch,
+					  uint64_t virt) {
+	uint64_t phys = leaf_phys(*entry, level);
+	size_t size = (size_t)1 << level_shift(level);
+	void *copy = level == 1 ? pmm_alloc(1)
+							: pmm_alloc_aligned(size / PAGE_SIZE, size);
+	if (copy == NULL)
+		return level == 2 && copy_leaf_split(entry, batch, virt);
+	pmm_set_type(copy, size / PAGE_SIZE, PAGE_TYPE_USER);
+	memcpy(copy + MEM_PHYS_OFFSET, (void *)phys + MEM_PHYS_OFFSET, size);
+	// Drop the reference to the shared page once no CPU can use it anymore
+	batch_free_page(batch, *entry, level);
+	// Everything but the address is kept
+	*entry = (uint64_t)copy | (*entry ^ phys);
+	vmm_tlb_add(batch, ALIGN_DOWN(virt, size));
+	return true;
+}
+
+// A large page shared since a fork has its reference count on its first 4KB
+// page only, it's copied before it's split so each 4KB page is counted on its
+// own
+static bool unshare_large_page(uint64_t *entry, int level,
+							   struct tlb_batch *batch, uint64_t virt) {
+	if (!(*entry & PTE_COW))
+		return true;
+	struct page *page = phys_to_page(leaf_phys(*entry, level));
+	if (page == NULL || page->refcount == 1)
+		return true;
+	return copy_leaf(entry, level, batch, virt);
+}
+
+// Returns "flags" for a leaf of a table of "level", in large pages the PAT
+// bit of 4KB pages is the size bit and it's at bit 12 instead
+static uint64_t leaf_flags(uint64_t flags, int level) {
+	if (level == 1 || !(flags & PTE_PAT))
+		return flags;
+	return (flags & ~PTE_PAT) | PTE_PAT_HUGE;
+}
+
+// Handles the leaf "entry" of a table of "level" mapping walk->virt
+static void walk_leaf(struct range_walk *walk, uint64_t *entry, int level) {
+	uint64_t huge = level > 1 ? PTE_HUGE : 0;
+	bool present = *entry & PTE_PRESENT;
+	// Kernel mappings stay in the TLB across page map switches
+	uint64_t global = walk->virt >= VMM_KERNEL_HALF ? PTE_GLOBAL : 0;
+	switch (walk->op) {
+		case RANGE_MAP:
+			if (walk->pages != NULL)
+				*entry = *walk->pages++ | walk->flags | global;
+			else
+				*entry =
+					walk->phys | leaf_flags(walk->flags, level) | huge | global;
+			break;
+		case RANGE_FREE:
+			if (*entry)
+				batch_free_page(&walk->batch, *entry, level);
+			*entry = 0;
+			break;
+		case RANGE_UNMAP:
+			*entry = 0;
+			break;
+		case RANGE_PROTECT:
+			if (*entry == 0)
+				return;
+			*entry = (*entry & ~PTE_PROT_MASK) | (walk->flags & PTE_PROT_MASK);
+			// Shared pages stay read-only until they're written to
+			if (*entry & PTE_COW)
+				*entry &= ~PTE_WRITABLE;
+			break;
+	}
+	if (present)
+		vmm_tlb_add(&walk->batch, walk->virt);
+}
 
-	// Use 1GB pages if requested
-	if (gbpages) {
-		uint32_t a = 0, b = 0, c = 0, d = 0;
-		if (__get_cpuid(0x80000001, &a, &b, &c, &d)) {
-			// Check for 1GB page support
-			if (d & CPUID_GBPAGE) {
-				pml3[pml3_entry] = phys_addr | flags | (1 << 7);
-				return true;
+// Walks the entries of "table" covering the rest of the range, descending
+// into lower levels only where a smaller page size is needed, so every table
+// is visited once per range instead of once per page
+static int walk_range(struct range_walk *walk, uint64_t *table, int level) {
+	uint64_t size = (uint64_t)1 << level_shift(level);
+	for (size_t i = level_index(walk->virt, level);
+		 i < 512 && walk->left; i++) {
+		uint64_t chunk = size - walk->virt % size;
+		if (chunk > walk->left)
+			chunk = walk->left;
+		// Leaves vmm_protect_range() made inaccessible aren't present but
+		// still map memory, every entry that isn't 0 is in use
+		bool used = table[i] != 0;
+		bool large = level < 4 && used && (table[i] & PTE_HUGE);
+		bool whole = chunk == size;
+		bool unmap = walk->op == RANGE_UNMAP || walk->op == RANGE_FREE;
+		bool leaf;
+		if (level == 1)
+			leaf = true;
+		else if (walk->op == RANGE_MAP)
+			// Use the page size of this level if the range allows it, but
+			// don't replace a table with a large page
+			leaf = whole && level < 4 && walk->pages == NULL &&
+				   walk->phys % size == 0 &&
+				   (!used || large) &&
+				   (level == 2 || cpu_has(CPU_FEATURE_GBPAGE));
+		else
+			leaf = whole && large;
+
+		if (leaf) {
+			walk_leaf(walk, &table[i], level);
+		} else if (unmap && whole && table_shared(table[i], level)) {
+			release_table(&table[i], &walk->batch, walk->virt,
+						  walk->op == RANGE_FREE);
+		} else if (used || walk->op == RANGE_MAP) {
+			// Don't create tables to unmap or protect nothing
+			uint64_t virt = walk->virt;
+			if (table_shared(table[i], level) &&
+				unshare_table(&table[i], &walk->batch, virt) == NULL)
+				return VMM_ENOMEM;
+			if (large &&
+				!unshare_large_page(&table[i], level, &walk->batch, virt))
+				return VMM_ENOMEM;
+			uint64_t *next_table =
+				get_next_level(table, i, level, walk->op == RANGE_MAP);
+			if (next_table == NULL)
+				return VMM_ENOMEM;
+			int ret = walk_range(walk, next_table, level - 1);
+			if (ret)
+				return ret;
+			// Higher half tables are kept: the PML3s are shared by every page
+			// map, and the paging-structure caches of every PCID may hold
+			// the lower ones, which invalidating the addresses doesn't drop
+			// for the PCIDs that aren't loaded
+			if (unmap && virt < VMM_KERNEL_HALF && table_empty(next_table)) {
+				// Free it once no CPU can walk it anymore
+				table[i] = 0;
+				batch_free_table(&walk->batch, next_table);
+				vmm_tlb_add(&walk->batch, virt);
 			}
+			continue;
 		}
+		walk->virt += chunk;
+		walk->phys += chunk;
+		walk->left -= chunk;
 	}
+	return 0;
+}
+
+// Walks the range of "walk" from the top level, without flushing its batch
+static int range_start(struct pagemap *pagemap, struct range_walk *walk) {
+	if ((walk->virt | walk->phys | walk->left) % PAGE_SIZE)
+		return VMM_EINVAL;
+	if (walk->left == 0)
+		return 0;
+	return walk_range(walk, (void *)pagemap->top_level + MEM_PHYS_OFFSET, 4);
+}
+
+static int range_op(struct pagemap *pagemap, enum range_op op, uint64_t virt,
+					uint64_t phys, size_t length, uint64_t flags) {
+	struct range_walk walk = {
+		.op = op,
+		.virt = virt,
+		.phys = phys,
+		.left = length,
+		.flags = flags,
+		.batch = {.pagemap = pagemap},
+	};
+	int ret = range_start(pagemap, &walk);
+	vmm_tlb_flush(&walk.batch);
+	return ret;
+}
+
+int vmm_map_range(struct pagemap *pagemap, uint64_t virt_addr,
+				  uint64_t phys_addr, size_t length, uint64_t flags) {
+	return range_op(pagemap, RANGE_MAP, virt_addr, phys_addr, length, flags);
+}
+
+int vmm_unmap_range(struct pagemap *pagemap, uint64_t virt_addr,
+					size_t length) {
+	return range_op(pagemap, RANGE_UNMAP, virt_addr, 0, length, 0);
+}
 
-	pml2 = get_next_level(pml3, pml3_entry);
-	if (pml2 == NULL)
+// Maps "count" 4KB pages that don't have to be physically contiguous, from
+// the addresses in "pages", in one walk
+int vmm_map_pages(struct pagemap *pagemap, uint64_t virt_addr,
+				  const uint64_t *pages, size_t count, uint64_t flags) {
+	struct range_walk walk = {
+		.op = RANGE_MAP,
+		.virt = virt_addr,
+		.pages = pages,
+		.left = count * PAGE_SIZE,
+		.flags = flags,
+		.batch = {.pagemap = pagemap},
+	};
+	int ret = range_start(pagemap, &walk);
+	vmm_tlb_flush(&walk.batch);
+	return ret;
+}
+
+// Unmaps a range like vmm_unmap_range(), but adds the invalidations and the
+// page tables to free to "batch", a batch of "pagemap", instead of flushing.
+// The range may be reachable through the TLB until vmm_tlb_flush(batch)
+int vmm_unmap_range_deferred(struct pagemap *pagemap, uint64_t virt_addr,
+							 size_t length, struct tlb_batch *batch) {
+	struct range_walk walk = {
+		.op = RANGE_UNMAP,
+		.virt = virt_addr,
+		.left = length,
+		.batch = *batch,
+	};
+	int ret = range_start(pagemap, &walk);
+	*batch = walk.batch;
+	return ret;
+}
+
+// Unmaps a range and frees the memory it mapped
+int vmm_free_range(struct pagemap *pagemap, uint64_t virt_addr,
+				   size_t length) {
+	return range_op(pagemap, RANGE_FREE, virt_addr, 0, length, 0);
+}
+
+int vmm_protect_range(struct pagemap *pagemap, uint64_t virt_addr,
+					  size_t length, uint64_t flags) {
+	return range_op(pagemap, RANGE_PROTECT, virt_addr, 0, length, flags);
+}
+
+struct fork_walk {
+	uint64_t virt;
+	// Bytes left
+	size_t left;
+	// Writes go to the same memory in both page maps
+	bool shared;
+	// Flushes the write access the source page map lost
+	struct tlb_batch batch;
+};
+
+// Maps the page of the leaf "src" of a table of "level" in the other page map
+// too, unless it's shared whichever writes to it first gets a copy
+static void fork_leaf(struct fork_walk *walk, uint64_t *src, uint64_t *dst,
+					  int level) {
+	if (walk->shared) {
+		*dst = *src;
+		pmm_get((void *)leaf_phys(*src, level));
+		return;
+	}
+	if (*src & PTE_WRITABLE)
+		vmm_tlb_add(&walk->batch, walk->virt);
+	*src = (*src & ~PTE_WRITABLE) | PTE_COW;
+	*dst = *src;
+	pmm_get((void *)leaf_phys(*src, level));
+}
+
+// Shares the page table referenced by the PML2 entry "src" with the other
+// page map instead of copying it
+static void fork_table(struct fork_walk *walk, uint64_t *src, uint64_t *dst) {
+	LOCK(share_lock);
+	if (!(*src & PTE_COW)) {
+		uint64_t *table = table_virt(*src);
+		for (size_t i = 0; i < 512; i++)
+			if ((table[i] & PTE_PRESENT) && (table[i] & PTE_WRITABLE))
+				vmm_tlb_add(&walk->batch, walk->virt + i * PAGE_SIZE);
+		*src = (*src & ~PTE_WRITABLE) | PTE_COW;
+	}
+	phys_to_page(*src & PTE_ADDR_MASK)->refcount++;
+	UNLOCK(share_lock);
+	*dst = *src;
+}
+
+static int fork_tables(struct fork_walk *walk, uint64_t *src, uint64_t *dst,
+					   int level) {
+	uint64_t size = (uint64_t)1 << level_shift(level);
+	for (size_t i = level_index(walk->virt, level);
+		 i < 512 && walk->left; i++) {
+		uint64_t chunk = size - walk->virt % size;
+		if (chunk > walk->left)
+			chunk = walk->left;
+		bool used = src[i] != 0;
+		bool large = level < 4 && used && (src[i] & PTE_HUGE);
+		bool whole = chunk == size;
+		if (used && (level == 1 || (large && whole))) {
+			fork_leaf(walk, &src[i], &dst[i], level);
+		} else if (used && level == 2 && whole && !walk->shared) {
+			fork_table(walk, &src[i], &dst[i]);
+		} else if (used) {
+			if (table_shared(src[i], level) &&
+				unshare_table(&src[i], &walk->batch, walk->virt) == NULL)
+				return VMM_ENOMEM;
+			if (large &&
+				!unshare_large_page(&src[i], level, &walk->batch, walk->virt))
+				return VMM_ENOMEM;
+			uint64_t *next_src = get_next_level(src, i, level, false);
+			uint64_t *next_dst = get_next_level(dst, i, level, true);
+			if (next_src == NULL || next_dst == NULL)
+				return VMM_ENOMEM;
+			int ret = fork_tables(walk, next_src, next_dst, level - 1);
+			if (ret)
+				return ret;
+			continue;
+		}
+		walk->virt += chunk;
+		walk->left -= chunk;
+	}
+	return 0;
+}
+
+// Maps what a range of "src" maps at the same place in "dst", copy-on-write:
+// the pages get a reference per page table mapping them and are read-only in
+// both page maps, and page tables the range fully covers are shared instead of
+// copied. If "shared" is set, the pages are mapped the same way in both page
+// maps instead. "dst" must have nothing mapped there
+int vmm_fork_range(struct pagemap *src, struct pagemap *dst, uint64_t virt_addr,
+				   size_t length, bool shared) {
+	if ((virt_addr | length) % PAGE_SIZE)
+		return VMM_EINVAL;
+	struct fork_walk walk = {
+		.virt = virt_addr,
+		.left = length,
+		.shared = shared,
+		.batch = {.pagemap = src},
+	};
+	int ret = fork_tables(&walk, (void *)src->top_level + MEM_PHYS_OFFSET,
+						  (void *)dst->top_level + MEM_PHYS_OFFSET, 4);
+	vmm_tlb_flush(&walk.batch);
+	return ret;
+}
+
+// Gives "entry", a copy-on-write leaf of a table of "level" mapping "virt",
+// its own copy of the page, or makes it writable if nothing else maps it
+static bool cow_leaf(uint64_t *entry, int level, struct tlb_batch *batch,
+					 uint64_t virt) {
+	struct page *page = phys_to_page(leaf_phys(*entry, level));
+	if ((page == NULL || page->refcount != 1) &&
+		!copy_leaf(entry, level, batch, virt))
 		return false;
+	// Copied as 4KB pages, only the one written to is made writable
+	if (level > 1 && !(*entry & PTE_HUGE))
+		entry = &table_virt(*entry)[level_index(virt, level - 1)];
+	*entry = (*entry & ~PTE_COW) | PTE_WRITABLE;
+	return true;
+}
 
-	// Use 2MB pages if requested
-	if (hugepages) {
-		pml2[pml2_entry] = phys_addr | flags | (1 << 7);
-		return true;
+// Resolves a write to a copy-on-write page, unsharing the page table on the
+// way if needed. False if the page isn't copy-on-write or memory ran out
+bool vmm_cow_fault(struct pagemap *pagemap, uint64_t virt_addr) {
+	struct tlb_batch batch = {.pagemap = pagemap};
+	uint64_t *table = (void *)pagemap->top_level + MEM_PHYS_OFFSET;
+	bool ret = false;
+	for (int level = 4; level > 0 && table != NULL; level--) {
+		uint64_t *entry = &table[level_index(virt_addr, level)];
+		if (!(*entry & PTE_PRESENT))
+			break;
+		if (level == 1 || (level < 4 && (*entry & PTE_HUGE))) {
+			// Writable already if another CPU got to it first
+			if (*entry & PTE_WRITABLE)
+				ret = true;
+			else if (*entry & PTE_COW)
+				ret = cow_leaf(entry, level, &batch, virt_addr);
+			break;
+		}
+		if (table_shared(*entry, level))
+			table = unshare_table(entry, &batch, virt_addr);
+		else
+			table = table_virt(*entry);
+	}
+	vmm_tlb_flush(&batch);
+	return ret;
+}
+
+// Returns the present leaf entry mapping "virt_addr" and the size of the page
+// it maps, NULL if there's none
+uint64_t *vmm_get_pte(struct pagemap *pagemap, uint64_t virt_addr,
+					  size_t *page_size) {
+	uint64_t *table = (void *)pagemap->top_level + MEM_PHYS_OFFSET;
+	for (int level = 4; level > 0; level--) {
+		uint64_t *entry = &table[level_index(virt_addr, level)];
+		if (!(*entry & PTE_PRESENT))
+			return NULL;
+		if (level == 1 || (level < 4 && (*entry & PTE_HUGE))) {
+			if (page_size != NULL)
+				*page_size = (size_t)1 << level_shift(level);
+			return entry;
+		}
+		table = table_virt(*entry);
+	}
+	return NULL;
+}
+
+// True if nothing is mapped in the 2MB block containing "virt_addr", not
+// even through a page table
+bool vmm_huge_unused(struct pagemap *pagemap, uint64_t virt_addr) {
+	uint64_t *table = (void *)pagemap->top_level + MEM_PHYS_OFFSET;
+	for (int level = 4; level > 2; level--) {
+		uint64_t entry = table[level_index(virt_addr, level)];
+		if (entry == 0)
+			return true;
+		if (level < 4 && (entry & PTE_HUGE))
+			return false;
+		table = table_virt(entry);
+	}
+	return table[level_index(virt_addr, 2)] == 0;
+}
+
+// Set by the CPU as the pages are used, they don't matter to a collapse
+#define COLLAPSE_IGNORED (PTE_ADDR_MASK | PTE_ACCESSED | PTE_DIRTY)
+
+// Returns the PML1 mapping the 2MB block at "virt_addr" and its PML2 entry in
+// "*entry" if its 4KB pages can be collapsed: all mapped, with the same flags,
+// and not shared with another page map. NULL otherwise
+static uint64_t *collapse_table(struct pagemap *pagemap, uint64_t virt_addr,
+								uint64_t **entry) {
+	uint64_t *table = (void *)pagemap->top_level + MEM_PHYS_OFFSET;
+	for (int level = 4; level > 2; level--) {
+		uint64_t next = table[level_index(virt_addr, level)];
+		if (!(next & PTE_PRESENT) || (level < 4 && (next & PTE_HUGE)))
+			return NULL;
+		table = table_virt(next);
 	}
+	*entry = &table[level_index(virt_addr, 2)];
+	if (!(**entry & PTE_PRESENT) || (**entry & (PTE_HUGE | PTE_COW)))
+		return NULL;
+	uint64_t *pml1 = table_virt(**entry);
+	uint64_t flags = pml1[0] & ~COLLAPSE_IGNORED;
+	if (!(flags & PTE_PRESENT) || (flags & (PTE_COW | PTE_PAT)))
+		return NULL;
+	for (size_t i = 0; i < 512; i++) {
+		if ((pml1[i] & ~COLLAPSE_IGNORED) != flags)
+			return NULL;
+		struct page *page = phys_to_page(pml1[i] & PTE_ADDR_MASK);
+		if (page == NULL || page->type != PAGE_TYPE_USER ||
+			page->refcount != 1)
+			return NULL;
+	}
+	return pml1;
+}
 
-	pml1 = get_next_level(pml2, pml2_entry);
+// Starts replacing the 4KB pages of the 2MB block at "virt_addr" by a 2MB
+// page holding a copy of them, false if they can't be collapsed. The caller
+// holds pagemap->lock. The pages are copied by vmm_collapse_copy() with the
+// lock dropped, their dirty bits are cleared to tell which ones were written
+// to meanwhile
+bool vmm_collapse_start(struct pagemap *pagemap, uint64_t virt_addr,
+						struct vmm_collapse *collapse) {
+	uint64_t *entry;
+	uint64_t *pml1 = collapse_table(pagemap, virt_addr, &entry);
 	if (pml1 == NULL)
 		return false;
+	collapse->pages = kmalloc(512 * sizeof(uint64_t));
+	if (collapse->pages == NULL)
+		return false;
+	collapse->huge = pmm_alloc_aligned(512, HUGE_PAGE_SIZE);
+	if (collapse->huge == NULL) {
+		kfree(collapse->pages);
+		return false;
+	}
+	pmm_set_type(collapse->huge, 512, PAGE_TYPE_USER);
+	collapse->virt = virt_addr;
+	collapse->flags = pml1[0] & ~COLLAPSE_IGNORED;
 
-	// Use 4KB pages otherwise
-	pml1[pml1_entry] = phys_addr | flags;
+	// A write through a TLB entry that's still dirty wouldn't set the bit
+	struct tlb_batch batch = {.pagemap = pagemap};
+	for (size_t i = 0; i < 512; i++) {
+		collapse->pages[i] = pml1[i] & PTE_ADDR_MASK;
+		pml1[i] &= ~PTE_DIRTY;
+		vmm_tlb_add(&batch, virt_addr + i * PAGE_SIZE);
+	}
+	vmm_tlb_flush(&batch);
+	return true;
+}
+
+// Copies the pages of a collapse, without the lock and with interrupts on
+void vmm_collapse_copy(struct vmm_collapse *collapse) {
+	for (size_t i = 0; i < 512; i++)
+		memcpy(collapse->huge + i * PAGE_SIZE + MEM_PHYS_OFFSET,
+			   (void *)collapse->pages[i] + MEM_PHYS_OFFSET, PAGE_SIZE);
+}
+
+// Maps the 2MB page of a collapse in place of the 4KB pages, with the lock
+// held again. "unchanged" tells that nothing else took the lock since
+// vmm_collapse_start(); the collapse is dropped if something did or if a page
+// was written to during the copy, and false returned
+bool vmm_collapse_finish(struct pagemap *pagemap,
+						 struct vmm_collapse *collapse, bool unchanged) {
+	uint64_t *entry;
+	uint64_t *pml1 =
+		unchanged ? collapse_table(pagemap, collapse->virt, &entry) : NULL;
+	bool ok = pml1 != NULL &&
+			  (pml1[0] & ~COLLAPSE_IGNORED) == collapse->flags;
+	for (size_t i = 0; ok && i < 512; i++)
+		ok = (pml1[i] & PTE_ADDR_MASK) == collapse->pages[i];
+
+	struct tlb_batch batch = {.pagemap = pagemap};
+	if (ok) {
+		// Writes fault until the copy is mapped
+		for (size_t i = 0; i < 512; i++) {
+			pml1[i] &= ~PTE_WRITABLE;
+			vmm_tlb_add(&batch, collapse->virt + i * PAGE_SIZE);
+		}
+		vmm_tlb_flush(&batch);
+		for (size_t i = 0; ok && i < 512; i++)
+			ok = !(pml1[i] & PTE_DIRTY);
+		// Written to during the copy, left for a later pass
+		for (size_t i = 0; !ok && i < 512; i++)
+			pml1[i] |= collapse->flags & PTE_WRITABLE;
+	}
+	kfree(collapse->pages);
+	if (!ok) {
+		pmm_free(collapse->huge, 512);
+		return false;
+	}
+
+	*entry = (uint64_t)collapse->huge | collapse->flags | PTE_HUGE;
+	for (size_t i = 0; i < 512; i++)
+		vmm_tlb_add(&batch, collapse->virt + i * PAGE_SIZE);
+	for (size_t i = 0; i < 512; i++)
+		batch_free_page(&batch, pml1[i], 1);
+	batch_free_table(&batch, pml1);
+	vmm_tlb_flush(&batch);
+	return true;
+}
+
+// Called by the scheduler when a CPU has nothing to run, collapses the 4KB
+// pages of private anonymous memory into 2MB pages now and then. A page map
+// is pinned while its pages are collapsed, with pagemaps_lock dropped: it's
+// held with interrupts off and collapses shoot down TLBs and copy 2MB
+void vmm_idle(void) {
+	if (timer_tick - last_collapse_tick < VMM_COLLAPSE_INTERVAL)
+		return;
+	// Another CPU is running the pass
+	if (!__sync_bool_compare_and_swap(&collapse_running, 0, 1))
+		return;
+	last_collapse_tick = timer_tick;
+	size_t left = VMM_COLLAPSE_MAX;
+	bool ints = vmm_lock_irqsave(&pagemaps_lock);
+	for (struct pagemap *pagemap = pagemaps; pagemap != NULL && left;
+		 pagemap = pagemap->next) {
+		pagemap->collapsing = true;
+		unlock_irqrestore(&pagemaps_lock, ints);
+		left -= vma_collapse(pagemap, left);
+		ints = vmm_lock_irqsave(&pagemaps_lock);
+		pagemap->collapsing = false;
+	}
+	unlock_irqrestore(&pagemaps_lock, ints);
+	UNLOCK(collapse_running);
+}
+
+// Unmaps the page of any size mapping "virt_addr", false if there's none
+bool vmm_unmap_page(struct pagemap *pagemap, uint64_t virt_addr) {
+	size_t size;
+	if (vmm_get_pte(pagemap, virt_addr, &size) == NULL)
+		return false;
+	return vmm_unmap_range(pagemap, ALIGN_DOWN(virt_addr, size), size) == 0;
+}
+
+// Maps a page, without the present bit in "flags" (bit 0), unmaps a page;
+// the argument "gbpages" has more priority than "hugepages", meaning that if
+// "hugepages" and "gbpages" are true, and if 1GB pages are available,
+// uses 1GB pages, if 1GB pages aren't available, uses 2MB pages
+bool vmm_map_page(struct pagemap *pagemap, uint64_t virt_addr,
+				  uint64_t phys_addr, uint64_t flags, bool hugepages,
+				  bool gbpages) {
+	int level = 1;
+	if (gbpages && cpu_has(CPU_FEATURE_GBPAGE))
+		level = 3;
+	else if (hugepages)
+		level = 2;
+
+	uint64_t *table = (void *)pagemap->top_level + MEM_PHYS_OFFSET;
+	for (int i = 4; i > level; i--) {
+		table = get_next_level(table, level_index(virt_addr, i), i, true);
+		if (table == NULL)
+			return false;
+	}
+	if (virt_addr >= VMM_KERNEL_HALF)
+		flags |= PTE_GLOBAL;
+	table[level_index(virt_addr, level)] =
+		phys_addr | leaf_flags(flags, level) | (level > 1 ? PTE_HUGE : 0);
 	return true;
 }
 
 void vmm_page_fault_handler(registers_t *reg) {
 	uint64_t faulting_address = 0;
 	asm("mov %0, cr2" : "=r"(faulting_address));
+	// Pages of an area are mapped the first time they're touched and copied
+	// the first time they're written to after a fork, the higher half is
+	// shared so its areas live in the kernel page map
+	struct pagemap *pagemap = kernel_pagemap;
+	if (faulting_address < VMM_KERNEL_HALF && cpu_locals != NULL &&
+		this_cpu->pagemap != NULL)
+		pagemap = this_cpu->pagemap;
+	if (vma_fault(pagemap, faulting_address, reg->errorCode))
+		return;
 	char x[256];
+	uint64_t id = 0;
+	const char *owner = kstack_guard_owner(faulting_address, &id);
+	if (owner != NULL) {
+		sprintf(x, "Kernel stack overflow: %s %llu, fault at 0x%llX", owner,
+				id, faulting_address);
+		PANIC(x);
+	}
 	int present = !(reg->errorCode & 0x1);
 	int read_write = reg->errorCode & 0x2;
 	int user_supervisor = reg->errorCode & 0x4;
@@ -19,28 +19,163 @@
  */
 
 #include "../cpu/isr.h"
+#include "../klibc/lock.h"
+#include "vma.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stivale2.h>
 
 #define PAGE_SIZE ((size_t)4096)
+#define HUGE_PAGE_SIZE ((size_t)0x200000)
+#define GB_PAGE_SIZE ((size_t)0x40000000)
 #define MEM_PHYS_OFFSET ((uint64_t)0xFFFF800000000000)
+// The higher half starts with the physical memory mapping, its PML4 entries
+// are shared by every page map
+#define VMM_KERNEL_HALF MEM_PHYS_OFFSET
+
+#define PTE_PRESENT ((uint64_t)1 << 0)
+#define PTE_WRITABLE ((uint64_t)1 << 1)
+#define PTE_USER ((uint64_t)1 << 2)
+#define PTE_PWT ((uint64_t)1 << 3)
+#define PTE_PCD ((uint64_t)1 << 4)
+#define PTE_ACCESSED ((uint64_t)1 << 5)
+#define PTE_DIRTY ((uint64_t)1 << 6)
+#define PTE_HUGE ((uint64_t)1 << 7)
+#define PTE_GLOBAL ((uint64_t)1 << 8)
+// The PAT bit is bit 7 in 4KB entries and bit 12 in 1GB and 2MB entries
+#define PTE_PAT ((uint64_t)1 << 7)
+#define PTE_PAT_HUGE ((uint64_t)1 << 12)
+// Ignored by the MMU. In a leaf, the page is shared since a fork and copied on
+// the first write. In a PML2 entry, the page table is shared since a fork and
+// read-only through it until it's copied
+#define PTE_COW ((uint64_t)1 << 9)
+#define PTE_NX ((uint64_t)1 << 63)
+// Memory types of a mapping, selecting the PAT entries wsmp_cpu_init()
+// programs. Given to the map functions with the 4KB page PAT bit, which they
+// move to bit 12 in large pages
+#define VMM_CACHE_WB ((uint64_t)0)
+#define VMM_CACHE_WT PTE_PWT
+#define VMM_CACHE_UC (PTE_PCD | PTE_PWT)
+#define VMM_CACHE_WP PTE_PAT
+#define VMM_CACHE_WC (PTE_PAT | PTE_PWT)
+#define PTE_ADDR_MASK ((uint64_t)0x000FFFFFFFFFF000)
+// The bits changed by vmm_protect_range(), without the present bit the page
+// stays mapped but can't be accessed
+#define PTE_PROT_MASK (PTE_PRESENT | PTE_WRITABLE | PTE_USER | PTE_NX)
+
+// Errors returned by the range functions
+#define VMM_ENOMEM (-1) // A page table couldn't be allocated
+#define VMM_EINVAL (-2) // An address or the length isn't page aligned
+#define VMM_EEXIST (-3) // The range overlaps an existing area
+#define VMM_ENOENT (-4) // Part of the range isn't in an area
+
+// Vector of the IPI asking other CPUs to flush their TLB
+#define VMM_SHOOTDOWN_VECTOR 253
+#define VMM_MAX_CPUS 256
+// PCID 0 is left to page maps loaded before PCIDs are handed out
+#define VMM_PCID_COUNT 4096
+// Invalidations kept per batch, past this count the whole TLB is flushed
+#define VMM_TLB_BATCH_MAX 32
+// Timer ticks between two passes of vmm_idle() collapsing 4KB pages into 2MB
+// pages, and the most 2MB pages a pass makes
+#define VMM_COLLAPSE_INTERVAL 1000
+#define VMM_COLLAPSE_MAX 8
 
 struct pagemap {
 	void *top_level;
+	// CPUs that have this page map loaded or still hold its PCID, one bit per
+	// CPU number
+	volatile uint64_t active_cpus[VMM_MAX_CPUS / 64];
+	// PCID of this page map on each CPU, 0 if it has none
+	uint16_t pcids[VMM_MAX_CPUS];
+	// Guards the areas, which are sorted by base address
+	lock_t lock;
+	vma_vec_t vmas;
+	// Bumped each time the lock is taken, to tell whether anything changed
+	// the areas or page tables while it was dropped
+	uint64_t lock_count;
+	// Next page map vmm_idle() goes through
+	struct pagemap *next;
+	// vmm_idle() is collapsing its pages, it isn't destroyed meanwhile
+	volatile bool collapsing;
+};
+
+// A collapse of the 4KB pages of a 2MB block, see vmm_collapse_start()
+struct vmm_collapse {
+	uint64_t virt;
+	// Flags of the 4KB pages
+	uint64_t flags;
+	void *huge;
+	// Physical addresses of the 4KB pages, in order
+	uint64_t *pages;
+};
+
+// TLB invalidations collected while changing a page map, flushed at once on
+// every CPU that may cache them
+struct tlb_batch {
+	struct pagemap *pagemap;
+	size_t count;
+	// Higher half addresses are flushed on every CPU
+	bool kernel;
+	uint64_t pages[VMM_TLB_BATCH_MAX];
+	// Page tables unlinked from the page map, freed after the flush
+	void *free_tables;
+	// Memory unmapped by vmm_free_range(), freed after the flush
+	struct {
+		uint64_t phys;
+		size_t count;
+	} free_pages[VMM_TLB_BATCH_MAX];
+	size_t free_page_count;
 };
 
 extern struct pagemap *kernel_pagemap;
+extern uint64_t vmm_init_cycles;
 
 void vmm_init(struct stivale2_mmap_entry *memmap, size_t memmap_entries,
 			  struct stivale2_pmr *pmrs, size_t pmr_entries,
 			  uint64_t virtual_base_address, uint64_t physical_base_address);
 void vmm_switch_pagemap(struct pagemap *pagemap);
+void vmm_cpu_online(void);
 struct pagemap *vmm_new_pagemap(void);
+void vmm_destroy_pagemap(struct pagemap *pagemap);
 bool vmm_map_page(struct pagemap *pagemap, uint64_t virt_addr,
 				  uint64_t phys_addr, uint64_t flags, bool hugepages,
 				  bool gbpages);
+// The range functions walk the page tables once for the whole range, mapping
+// with the biggest page size the alignment of both addresses allows and
+// splitting large pages only partially covered. Unmapping frees page tables
+// left empty. They return 0 on success or a negative VMM_E* error, a range may
+// be left partially changed on failure
+int vmm_map_range(struct pagemap *pagemap, uint64_t virt_addr,
+				  uint64_t phys_addr, size_t length, uint64_t flags);
+int vmm_map_pages(struct pagemap *pagemap, uint64_t virt_addr,
+				  const uint64_t *pages, size_t count, uint64_t flags);
+int vmm_unmap_range(struct pagemap *pagemap, uint64_t virt_addr,
+					size_t length);
+int vmm_unmap_range_deferred(struct pagemap *pagemap, uint64_t virt_addr,
+							 size_t length, struct tlb_batch *batch);
+int vmm_free_range(struct pagemap *pagemap, uint64_t virt_addr,
+				   size_t length);
+int vmm_fork_range(struct pagemap *src, struct pagemap *dst, uint64_t virt_addr,
+				   size_t length, bool shared);
+bool vmm_cow_fault(struct pagemap *pagemap, uint64_t virt_addr);
+bool vmm_huge_unused(struct pagemap *pagemap, uint64_t virt_addr);
+bool vmm_collapse_start(struct pagemap *pagemap, uint64_t virt_addr,
+						struct vmm_collapse *collapse);
+void vmm_collapse_copy(struct vmm_collapse *collapse);
+bool vmm_collapse_finish(struct pagemap *pagemap,
+						 struct vmm_collapse *collapse, bool unchanged);
+void vmm_idle(void);
+bool vmm_unmap_page(struct pagemap *pagemap, uint64_t virt_addr);
+uint64_t *vmm_get_pte(struct pagemap *pagemap, uint64_t virt_addr,
+					  size_t *page_size);
+int vmm_protect_range(struct pagemap *pagemap, uint64_t virt_addr,
+					  size_t length, uint64_t flags);
+void vmm_tlb_add(struct tlb_batch *batch, uint64_t virt_addr);
+void vmm_tlb_flush(struct tlb_batch *batch);
+void vmm_tlb_poll(void);
+bool vmm_lock_irqsave(lock_t *lock);
 void vmm_page_fault_handler(registers_t *reg);
 
 #endif
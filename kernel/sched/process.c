@@ -20,6 +20,7 @@
 #include "../klibc/lock.h"
 #include "../klibc/printf.h"
 #include "../klibc/string.h"
+#include "../mm/slab.h"
 #include "scheduler.h"
 
 process_vec_t ptable;
@@ -27,9 +28,12 @@ struct process *initproc;
 static uint32_t next_pid = 0;
 static bool is_init = true;
 lock_t process_lock;
+static struct kmem_cache *process_cache;
 
 static struct process *alloc_new_process(void) {
-	struct process *proc = kmalloc(sizeof(struct process));
+	struct process *proc = kmem_cache_alloc(process_cache);
+	if (!proc)
+		PANIC("Failed to allocate process");
 	LOCK(process_lock);
 
 	proc->state = INITIAL;
@@ -64,6 +68,9 @@ void process_create(char *name, uintptr_t addr, uint64_t args,
 void process_init(uintptr_t addr, uint64_t args) {
 	if (!is_init)
 		return;
+	process_cache =
+		kmem_cache_create("process", sizeof(struct process), 0, NULL);
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread), 0, NULL);
 	struct process *proc = alloc_new_process();
 	strcpy(proc->name, "kernel_tasks");
 	proc->parent = NULL;
@@ -80,23 +87,39 @@ void process_init(uintptr_t addr, uint64_t args) {
 	is_init = false;
 }
 
-uint32_t process_fork(uint8_t timeslice) {
-	if (timeslice < 1 || timeslice > 16)
-		return -1;
+extern uint32_t context_fork(uint32_t (*func)(struct cpu_context *, void *),
+							 void *arg);
+extern void *call_on_stack(void *(*func)(void *), void *arg, void *stack);
+
+static void *fork_pagemap(void *pagemap) {
+	return vma_fork(pagemap);
+}
 
+// Called by process_fork() with the context the child resumes from saved on
+// the stack, so it's part of the memory the child gets a copy of
+static uint32_t fork_child(struct cpu_context *context, void *timeslice) {
 	struct process *parent = running_proc();
 
+	// The stack we run on is in the process' memory, which vma_fork() makes
+	// copy-on-write with the lock the write fault takes held, so it runs on
+	// a kernel stack
+	uint8_t *stack = kstack_alloc("fork", parent->pid);
+	if (stack == NULL)
+		return -1;
+	struct pagemap *pagemap = call_on_stack(
+		fork_pagemap, parent->process_pagemap, stack + KSTACK_SIZE);
+	kstack_free(stack);
+	if (pagemap == NULL)
+		return -1;
+
 	struct process *child = alloc_new_process();
 	if (!child) {
 		PANIC("Failed to allocate new child process");
 		__builtin_unreachable();
 	}
 
-	child->timeslice = timeslice;
-
-	child->ttable.data[0]->context->rip =
-		(uintptr_t)__builtin_return_address(0);
-	child->ttable.data[0]->context->rax = 0;
+	child->timeslice = *(uint8_t *)timeslice;
+	child->process_pagemap = pagemap;
 
 	child->parent = parent;
 	strcpy(child->name, parent->name);
@@ -104,6 +127,10 @@ uint32_t process_fork(uint8_t timeslice) {
 	child->killed = false;
 	child->priority = parent->priority;
 
+	// Only the calling thread is copied
+	vec_init(&child->ttable);
+	thread_fork(child, context);
+
 	LOCK(process_lock);
 	child->state = READY;
 	UNLOCK(process_lock);
@@ -111,6 +138,19 @@ uint32_t process_fork(uint8_t timeslice) {
 	return child->pid;
 }
 
+// Returns the child's PID in the parent and 0 in the child, which gets a
+// copy-on-write copy of the parent's memory
+uint32_t process_fork(uint8_t timeslice) {
+	if (timeslice < 1 || timeslice > 16)
+		return -1;
+
+	// The kernel process' memory isn't its own to copy
+	if (running_proc()->process_pagemap == kernel_pagemap)
+		return -1;
+
+	return context_fork(fork_child, &timeslice);
+}
+
 inline void process_block(enum block_on reason) {
 	asm volatile("cli");
 	struct process *proc = running_proc();
@@ -135,10 +175,8 @@ void process_exit(void) {
 	if (proc->parent->state == BLOCKED && proc->parent->block_on == ON_WAIT)
 		process_unblock(proc->parent);
 	for(int i = 0; i < proc->ttable.length; i++) {
-		if (proc->ttable.data[i]->state_t != TERMINATED) {
-			kfree(proc->ttable.data[i]->tstack);
-			proc->ttable.data[i]->state_t = TERMINATED;
-		}
+		proc->ttable.data[i]->state_t = TERMINATED;
+		thread_free_stack(proc->ttable.data[i]);
 	}
 	for (int i = 0; i < ptable.length; i++) {
 		struct process *child = ptable.data[i];
@@ -149,9 +187,13 @@ void process_exit(void) {
 		}
 	}
 	proc->state = TERMINATED;
+	if (proc->process_pagemap != kernel_pagemap) {
+		vmm_switch_pagemap(kernel_pagemap);
+		vmm_destroy_pagemap(proc->process_pagemap);
+	}
 	vec_clear(&proc->ttable);
 	vec_deinit(&proc->ttable);
-	kfree(proc);
+	kmem_cache_free(process_cache, proc);
 	yield_to_scheduler();
 }
 
@@ -184,7 +226,7 @@ uint32_t process_wait(void) {
 
 			if (child->state == TERMINATED) {
 				for (int i = 0; i < child->ttable.length; i++)
-					kfree(child->ttable.data[i]->tstack);
+					thread_free_stack(child->ttable.data[i]);
 
 				uint32_t child_pid = child->pid;
 				child->pid = 0;
@@ -18,14 +18,13 @@
  */
 
 #include "../klibc/vec.h"
+#include "../mm/kstack.h"
 #include "sched_types.h"
 #include "thread.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-#define KSTACK_SIZE 32768
-
 extern process_vec_t ptable;
 
 void process_create(char *name, uintptr_t addr, uint64_t args,
@@ -20,6 +20,8 @@
 #include "../kernel/panic.h"
 #include "../klibc/lock.h"
 #include "../klibc/printf.h"
+#include "../mm/pmm.h"
+#include "../mm/vmalloc.h"
 
 lock_t sched_lock;
 
@@ -30,8 +32,9 @@ void sched_init(void) {
 		asm volatile("sti");
 		LOCK(sched_lock);
 		// Primitive priority system
-		struct process *toproc = kmalloc(sizeof(struct process));
-		struct thread *topthrd = kmalloc(sizeof(struct thread));
+		struct process *toproc = NULL;
+		struct thread *topthrd = NULL;
+		bool idle = true;
 		for (int i = 0; i < ptable.length; i++) {
 			struct process *proc = ptable.data[i];
 			if (proc->state != READY)
@@ -39,13 +42,25 @@ void sched_init(void) {
 			for (int j = 0; j < proc->ttable.length; j++) {
 				if (proc->ttable.data[j]->state_t != READY)
 					continue;
-				if (proc->priority >= toproc->priority) {
+				if (toproc == NULL || proc->priority >= toproc->priority) {
 					topthrd = proc->ttable.data[j];
 					toproc = proc;
+					idle = false;
 				}
 			}
 		}
 
+		if (idle) {
+			UNLOCK(sched_lock);
+			// Nothing is ready, let the PMM shrink caches or zero pages, the
+			// VMM collapse 4KB pages into 2MB ones and vmalloc() purge what
+			// the shrinker asked for
+			pmm_idle();
+			vmm_idle();
+			vmalloc_idle();
+			continue;
+		}
+
 		size_t next_sched_tick = timer_tick + toproc->timeslice;
 		while (timer_tick < next_sched_tick && toproc->state == READY) {
 			this_cpu->cpu_state->running_proc = toproc;
@@ -54,14 +69,20 @@ void sched_init(void) {
 			topthrd->state_t = RUNNING;
 			if (toproc->process_pagemap == NULL)
 				PANIC("running process does not have process pagemap");
+			vmm_switch_pagemap(toproc->process_pagemap);
 			context_switch(&this_cpu->cpu_state->scheduler, topthrd->context);
+			// Nothing runs on the stack of a thread that exited anymore
+			if (this_cpu->exited_stack != NULL) {
+				kstack_free(this_cpu->exited_stack);
+				this_cpu->exited_stack = NULL;
+			}
 
 			this_cpu->cpu_state->running_proc = NULL;
 			this_cpu->cpu_state->running_thrd = NULL;
 		}
-		// Free memory used for top-most process
-		kfree(toproc);
-		kfree(topthrd);
+		// Don't keep the page map loaded while the process isn't running, it
+		// may exit and be destroyed; cheap with PCIDs
+		vmm_switch_pagemap(kernel_pagemap);
 		UNLOCK(sched_lock);
 	}
 }
@@ -22,3 +22,32 @@ context_switch:
 	mov rsp, rsi
 	popall
 	ret
+
+global context_fork
+
+; Saves the caller's registers as a context that resumes it with context_fork()
+; returning 0, then calls func(context, arg) while the context is still on the
+; stack and returns what it returns
+context_fork:
+	pushall
+	mov qword [rsp + 14 * 8], 0
+	mov rax, rdi
+	mov rdi, rsp
+	call rax
+	add rsp, 15 * 8
+	ret
+
+global call_on_stack
+
+; Calls func(arg) with the stack pointer at "stack", 16-byte aligned, and
+; returns what it returns on the caller's stack
+call_on_stack:
+	push rbp
+	mov rbp, rsp
+	mov rsp, rdx
+	mov rax, rdi
+	mov rdi, rsi
+	call rax
+	mov rsp, rbp
+	pop rbp
+	ret
@@ -21,31 +21,34 @@
 #include "../klibc/lock.h"
 #include "../klibc/printf.h"
 #include "../mm/pmm.h"
+#include "../mm/slab.h"
 #include "scheduler.h"
-#include <cpuid.h>
 
 static uint32_t nextid = 1;
 lock_t thread_lock;
+struct kmem_cache *thread_cache;
 
-struct thread *alloc_new_thread(void) {
-	struct thread *thrd = kmalloc(sizeof(struct thread));
+struct thread *alloc_new_thread(struct process *proc, uintptr_t addr,
+								 uint64_t args) {
+	struct thread *thrd = kmem_cache_alloc(thread_cache);
+	if (!thrd)
+		PANIC("Failed to allocate thread");
 	LOCK(thread_lock);
-	if (running_proc()->pid < 1)
-		thrd->tstack = kmalloc(TSTACK_SIZE);
+	if (proc->process_pagemap == kernel_pagemap)
+		thrd->tstack = kstack_alloc("kernel thread", nextid);
 	else {
-		thrd->tstack = pmm_allocz(TSTACK_SIZE / PAGE_SIZE);
-		uint32_t a = 0, b = 0, c = 0, d = 0;
-		if (__get_cpuid(0x80000001, &a, &b, &c, &d)) {
-			for (uintptr_t p = 0; p < TSTACK_SIZE; p += PAGE_SIZE) {
-				if (d & CPUID_GBPAGE) {
-					vmm_map_page(running_proc()->process_pagemap, p,
-								 (uint64_t)thrd->tstack + p, 0b11, false, true);
-				} else {
-					vmm_map_page(running_proc()->process_pagemap, p,
-								 (uint64_t)thrd->tstack + p, 0b11, true, false);
-				}
-			}
-		}
+		// The gap below each stack is left unmapped. The kernel runs on it,
+		// so it's all faulted in now: a fault while growing it could come
+		// with a lock the fault path takes held
+		uint64_t base =
+			TSTACK_AREA_BASE + (uint64_t)nextid * (TSTACK_SIZE + PAGE_SIZE);
+		thrd->tstack = NULL;
+		if (vma_add(proc->process_pagemap, base, TSTACK_SIZE,
+					PTE_PRESENT | PTE_WRITABLE | PTE_NX, VMA_ANONYMOUS) == 0)
+			thrd->tstack = (void *)base;
+		for (size_t i = 0; thrd->tstack && i < TSTACK_SIZE; i += PAGE_SIZE)
+			if (!vma_fault(proc->process_pagemap, base + i, 0x2))
+				thrd->tstack = NULL;
 	}
 	if (!thrd->tstack)
 		PANIC("Failed to allocate kernel stack page");
@@ -56,14 +59,22 @@ struct thread *alloc_new_thread(void) {
 	uint64_t sp = (uintptr_t)thrd->tstack + KSTACK_SIZE;
 	sp -= sizeof(struct cpu_context);
 	thrd->context = (struct cpu_context *)sp;
-	memset(thrd->context, 0, sizeof(struct cpu_context));
+	// The process' page map may not be the one loaded, write the context
+	// through the higher half
+	struct cpu_context *context = thrd->context;
+	if (proc->process_pagemap != kernel_pagemap) {
+		uint64_t *pte = vmm_get_pte(proc->process_pagemap, sp, NULL);
+		context = (void *)(*pte & PTE_ADDR_MASK) + MEM_PHYS_OFFSET +
+				  sp % PAGE_SIZE;
+	}
+	memset(context, 0, sizeof(struct cpu_context));
+	context->rip = addr;
+	context->rdi = args;
 	return thrd;
 }
 
 void thread_init(uintptr_t addr, uint64_t args, struct process *proc) {
-	struct thread *thrd = alloc_new_thread();
-	thrd->context->rip = addr;
-	thrd->context->rdi = args;
+	struct thread *thrd = alloc_new_thread(proc, addr, args);
 	thrd->killed = false;
 	LOCK(thread_lock);
 	thrd->state_t = READY;
@@ -72,9 +83,7 @@ void thread_init(uintptr_t addr, uint64_t args, struct process *proc) {
 }
 
 void thread_create(uintptr_t addr, uint64_t args) {
-	struct thread *thrd = alloc_new_thread();
-	thrd->context->rip = addr;
-	thrd->context->rdi = args;
+	struct thread *thrd = alloc_new_thread(running_proc(), addr, args);
 	thrd->killed = false;
 	LOCK(thread_lock);
 	thrd->state_t = READY;
@@ -82,6 +91,24 @@ void thread_create(uintptr_t addr, uint64_t args) {
 	vec_push(&running_proc()->ttable, thrd);
 }
 
+// Adds a copy of the running thread to "proc", a copy of the running
+// process: its stack is at the same place in the copied memory and it resumes
+// from "context", saved on it
+void thread_fork(struct process *proc, struct cpu_context *context) {
+	struct thread *thrd = kmem_cache_alloc(thread_cache);
+	if (!thrd)
+		PANIC("Failed to allocate thread");
+	LOCK(thread_lock);
+	thrd->tstack = running_thrd()->tstack;
+	thrd->context = context;
+	thrd->block_t = NOTHING;
+	thrd->tid = nextid++;
+	thrd->killed = false;
+	thrd->state_t = READY;
+	UNLOCK(thread_lock);
+	vec_push(&proc->ttable, thrd);
+}
+
 inline void thread_block(enum block_on reason) {
 	asm volatile("cli");
 	struct thread *thrd = running_thrd();
@@ -96,13 +123,27 @@ inline void thread_unblock(struct thread *thrd) {
 	thrd->state_t = READY;
 }
 
+// Frees the stack of a terminated thread, once the scheduler switched away
+// from it if it's the running one. Stacks in a process' areas are freed with
+// its page map
+void thread_free_stack(struct thread *thrd) {
+	if ((uint64_t)thrd->tstack < VMM_KERNEL_HALF)
+		return;
+	if (thrd == running_thrd())
+		this_cpu->exited_stack = thrd->tstack;
+	else
+		kstack_free(thrd->tstack);
+	thrd->tstack = NULL;
+}
+
 void thread_exit(uint64_t return_val) {
 	struct thread *thrd = running_thrd();
-	kfree(thrd->tstack);
 	if (thrd->state_t == BLOCKED && thrd->block_t == ON_WAIT)
 		thread_unblock(thrd);
 	thrd->state_t = TERMINATED;
 	thrd->return_val = return_val;
+	// Never resumed now, so the timer can't switch back to the stack
+	thread_free_stack(thrd);
 	if (thrd == running_proc()->ttable.data[0]) {
 		running_proc()->return_code = (uint8_t)thrd->return_val;
 		process_exit();
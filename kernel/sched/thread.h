@@ -25,11 +25,18 @@
 #include <stdint.h>
 
 #define TSTACK_SIZE 32768
+// Where stacks of threads outside the kernel process are placed
+#define TSTACK_AREA_BASE ((uint64_t)0x700000000000)
+
+// Created with the cache of processes by process_init()
+extern struct kmem_cache *thread_cache;
 
 void thread_init(uintptr_t addr, uint64_t args, struct process *proc);
 void thread_create(uintptr_t addr, uint64_t args);
+void thread_fork(struct process *proc, struct cpu_context *context);
 void thread_block(enum block_on reason);
 void thread_exit(uint64_t return_val);
+void thread_free_stack(struct thread *thrd);
 void thread_unblock(struct thread *thread);
 void thread_sleep(size_t sleep_ticks);
 
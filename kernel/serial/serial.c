@@ -16,10 +16,14 @@
  */
 
 #include "serial.h"
+#include "../cpu/apic.h"
+#include "../cpu/cpu.h"
+#include "../cpu/isr.h"
 #include "../cpu/ports.h"
 #include "../klibc/lock.h"
 
 lock_t serial_lock;
+static void (*input_handler)(char) = NULL;
 
 void serial_install(void) {
 	port_byte_out(COM1, 0);
@@ -44,13 +48,34 @@ void write_serial_char(char word) {
 }
 
 void write_serial(char *word) {
+	// Interrupts go off first, an interrupt handler may write too
+	bool ints = interrupts_save();
 	LOCK(serial_lock);
-	asm volatile("cli");
 
 	while (*word != '\0') {
 		write_serial_char(*word++);
 	}
 
 	UNLOCK(serial_lock);
-	asm volatile("sti");
+	interrupts_restore(ints);
+}
+
+static void serial_interrupt(registers_t *reg) {
+	(void)reg;
+	// Data ready
+	while (port_byte_in(COM1 + 5) & 1) {
+		char c = port_byte_in(COM1);
+		if (input_handler != NULL)
+			input_handler(c);
+	}
+}
+
+// Calls "handler" from an interrupt handler with each character received,
+// once the I/O APIC is set up
+void serial_set_input_handler(void (*handler)(char)) {
+	input_handler = handler;
+	isr_register_handler(COM1_VECTOR, serial_interrupt);
+	ioapic_redirect_irq(4, COM1_VECTOR);
+	// Interrupt when data is received
+	port_byte_out(COM1 + 1, 1);
 }
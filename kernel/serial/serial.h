@@ -19,8 +19,11 @@
  */
 
 #define COM1 0x3F8
+// COM1's IRQ as remapped by the I/O APIC
+#define COM1_VECTOR (48 + 4)
 
 void serial_install(void);
+void serial_set_input_handler(void (*handler)(char));
 void write_serial(char *word);
 void write_serial_char(char word);
 
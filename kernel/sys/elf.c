@@ -3,6 +3,7 @@
 #include "../klibc/mem.h"
 #include "../klibc/printf.h"
 #include "../klibc/string.h"
+#include "../mm/vmalloc.h"
 #include "../sched/process.h"
 #include <liballoc.h>
 #include <stddef.h>
@@ -79,8 +80,9 @@ int load_elf(char *file_name) {
 
 		// If this section should allocate memory and is bigger than 0
 		if ((section->flags & ELF_FLAG_ALLOC) && section->size > 0) {
-			// Allocate memory, currenty RW so we can write to it
-			char *mem = kmalloc(section->size);
+			// Allocate memory, currenty RW so we can write to it. Sections
+			// can be large, they don't need physically contiguous memory
+			char *mem = vmalloc(section->size);
 
 			if (section->type == ELF_SECTION_PROGBITS) {
 				// Read data from the file
@@ -95,7 +97,7 @@ int load_elf(char *file_name) {
 		// Load symbol and string tables from the file
 		if (section->type == ELF_SECTION_SYMTAB ||
 			section->type == ELF_SECTION_STRTAB) {
-			struct elf64_symbol *table = kmalloc(section->size);
+			struct elf64_symbol *table = vmalloc(section->size);
 
 			res->read(res, table, section->offset, section->size);
 
@@ -115,7 +117,7 @@ int load_elf(char *file_name) {
 			}
 
 			// Load relocation entries from the file
-			struct elf64_rela_entry *entries = kmalloc(section->size);
+			struct elf64_rela_entry *entries = vmalloc(section->size);
 			section->address = (uint64_t)(size_t)entries;
 			res->read(res, entries, section->offset, section->size);
 
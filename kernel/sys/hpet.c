@@ -72,6 +72,12 @@ uint64_t hpet_counter_value(void) {
 	return mminq(&hpet->main_counter_value);
 }
 
+uint64_t hpet_get_ns(void) {
+	// The counter period is given in femtoseconds
+	uint64_t ticks = hpet_counter_value();
+	return (ticks / 1000000) * clk + ((ticks % 1000000) * clk) / 1000000;
+}
+
 void hpet_usleep(uint64_t us) {
 	uint64_t target = hpet_counter_value() + (us * 1000000000) / clk;
 	while (hpet_counter_value() < target)
@@ -16,7 +16,10 @@
  */
 
 #include "video.h"
+#include "../kernel/panic.h"
 #include "../klibc/lock.h"
+#include "../klibc/math.h"
+#include "../mm/vmm.h"
 #include "../serial/serial.h"
 #define SSFN_CONSOLEBITMAP_TRUECOLOR
 #include "ssfn.h"
@@ -51,19 +54,39 @@ void video_init(struct stivale2_struct_tag_framebuffer *framebuffer) {
 	ssfn_dst.x = ssfn_dst.y = 0;
 }
 
+// Remaps the framebuffer with a VMM_CACHE_* memory type, write-combining lets
+// the CPU send writes to it in bursts instead of one by one. Only once the
+// PAT is programmed. The identity mapping of it is dropped: two mappings with
+// different memory types would be an alias the CPU may not keep coherent,
+// and it's only ever accessed through the higher half
+void video_set_cache(uint64_t cache) {
+	uint64_t base = ALIGN_DOWN((uint64_t)fb_addr, PAGE_SIZE);
+	uint64_t top =
+		ALIGN_UP((uint64_t)fb_addr + fb_pitch * height_s, PAGE_SIZE);
+	if (vmm_unmap_range(kernel_pagemap, base - MEM_PHYS_OFFSET, top - base) ||
+		vmm_map_range(kernel_pagemap, base, base - MEM_PHYS_OFFSET, top - base,
+					  PTE_PRESENT | PTE_WRITABLE | PTE_NX | cache))
+		PANIC("Failed to map the framebuffer");
+}
+
 void draw_px(int x, int y, uint32_t color) {
 	size_t py = y * fb_pitch;
 	size_t px = x * (fb_bpp / 8);
 	*(uint32_t *)(&fb_addr[px + py]) = color;
 }
 
-void knewline(void) {
+// Moves the screen up by a line of text
+void video_scroll(void) {
 	for (uint32_t y = ssfn_src->height; y != height_s; ++y) {
 		void *dest =
 			(void *)(((uintptr_t)fb_addr) + (y - ssfn_src->height) * fb_pitch);
 		const void *src = (void *)(((uintptr_t)fb_addr) + y * fb_pitch);
 		memcpy(dest, src, width_s * 4);
 	}
+}
+
+void knewline(void) {
+	video_scroll();
 
 	cursor_y--;
 	cursor_x = 131;
@@ -26,6 +26,8 @@
 
 void vid_reset(void);
 void video_init(struct stivale2_struct_tag_framebuffer *framebuffer);
+void video_set_cache(uint64_t cache);
+void video_scroll(void);
 void putchar_color(int c, uint32_t color, uint32_t bgcolor);
 void putcharx(int c);
 void kprint_color(char *string, uint32_t color);